@@ -2,6 +2,20 @@
 #include "archive.h"
 #include "huffman.h"
 #include "kitty.h"
+#include "block.h"
+#include "threadpool.h"
+#include "fileio.h"
+#include "checksum.h"
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <algorithm>
+#include <future>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <memory>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -23,7 +37,239 @@ static void gatherFiles(const fs::path& base, const fs::path& p,
     }
 }
 
-void createArchive(const vector<string>& inputs, const string& outputArchive) {
+static void appendBytes(vector<uint8_t>& buf, const void* p, size_t n) {
+    const uint8_t* b = static_cast<const uint8_t*>(p);
+    buf.insert(buf.end(), b, b + n);
+}
+
+// file_time_type has an implementation-defined epoch; the archive stores
+// seconds since the Unix epoch. The epochs differ by whole seconds, so the
+// measured offset is rounded to keep conversions exact both ways.
+static std::chrono::seconds fileClockOffset() {
+    using namespace std::chrono;
+    static const seconds offset = round<seconds>(fs::file_time_type::clock::now().time_since_epoch() -
+                                                 system_clock::now().time_since_epoch());
+    return offset;
+}
+
+static int64_t toUnixTime(fs::file_time_type t) {
+    using namespace std::chrono;
+    return (int64_t)floor<seconds>(t.time_since_epoch() - fileClockOffset()).count();
+}
+
+static fs::file_time_type fromUnixTime(int64_t secs) {
+    using namespace std::chrono;
+    return fs::file_time_type(duration_cast<fs::file_time_type::duration>(seconds(secs) + fileClockOffset()));
+}
+
+// Central directory record: pathLen u16, path, flags u8, offset u64,
+// origSize u64, dataSize u64, crc32 u32, mtime i64 (+ chunk list when chunked).
+// store, for version 6, adds the chunk and block tables.
+static vector<uint8_t> encodeDirectory(const vector<ArchiveEntry>& entries, uint64_t dirOffset,
+                                       const ChunkStoreWriter* store = nullptr) {
+    vector<uint8_t> buf;
+    for (auto& e : entries) {
+        uint16_t pathLen = (uint16_t)e.path.size();
+        appendBytes(buf, &pathLen, 2);
+        appendBytes(buf, e.path.data(), pathLen);
+        appendBytes(buf, &e.flags, 1);
+        appendBytes(buf, &e.offset, 8);
+        appendBytes(buf, &e.origSize, 8);
+        appendBytes(buf, &e.dataSize, 8);
+        appendBytes(buf, &e.crc32, 4);
+        appendBytes(buf, &e.mtime, 8);
+        if (e.flags & ARCHIVE_ENTRY_CHUNKED) {
+            uint32_t n = (uint32_t)e.chunks.size();
+            appendBytes(buf, &n, 4);
+            appendBytes(buf, e.chunks.data(), n * 4);
+        }
+    }
+    if (store) {
+        uint32_t n = (uint32_t)store->chunks().size();
+        appendBytes(buf, &n, 4);
+        for (auto& c : store->chunks()) {
+            appendBytes(buf, &c.storeOffset, 8);
+            appendBytes(buf, &c.size, 4);
+            appendBytes(buf, &c.hash.lo, 8);
+            appendBytes(buf, &c.hash.hi, 8);
+        }
+        n = (uint32_t)store->blocks().size();
+        appendBytes(buf, &n, 4);
+        for (auto& b : store->blocks()) {
+            appendBytes(buf, &b.offset, 8);
+            appendBytes(buf, &b.compressedSize, 4);
+            appendBytes(buf, &b.rawSize, 4);
+        }
+    }
+    uint32_t count = (uint32_t)entries.size();
+    appendBytes(buf, &dirOffset, 8);
+    appendBytes(buf, &count, 4);
+    appendBytes(buf, "KPCD", 4);
+    return buf;
+}
+
+// Queues one entry: local header (dataSize patched once known) and its
+// .kitty stream. entries[idx] is filled in as the pieces are committed.
+static void queueEntry(OrderedWriter& writer, ThreadPool& pool, ostream& out, const ArchiveInput& f,
+                       const CompressOptions& options, vector<ArchiveEntry>& entries, size_t idx) {
+    // Map the input when possible so workers read blocks in place;
+    // otherwise stream it
+    auto map = make_shared<MappedFile>(f.absPath);
+    ifstream in;
+    if (!map->valid()) {
+        in.open(f.absPath, ios::binary);
+        if (!in) throw runtime_error("Cannot open input: " + f.absPath);
+    }
+    uint64_t origSize = map->valid() ? map->size() : (uint64_t)fs::file_size(f.absPath);
+
+    ArchiveEntry& e = entries[idx];
+    e.path = f.relPath;
+    e.flags = ARCHIVE_ENTRY_COMPRESSED;
+    e.origSize = origSize;
+    e.dataSize = 0;
+    e.mtime = toUnixTime(fs::last_write_time(f.absPath));
+
+    // dataSize is only known once the entry's stream is committed,
+    // so the entry header goes out with a placeholder and is patched
+    uint16_t pathLen = (uint16_t)f.relPath.size();
+    vector<uint8_t> header;
+    appendBytes(header, &pathLen, 2);
+    appendBytes(header, f.relPath.data(), pathLen);
+    appendBytes(header, &e.flags, 1);
+    appendBytes(header, &origSize, 8);
+    appendBytes(header, &e.dataSize, 8);
+    writer.push(move(header), [&entries, idx](uint64_t at, const vector<uint8_t>& bytes) {
+        entries[idx].offset = at + bytes.size();
+    });
+
+    auto onDone = [&out, &entries, idx](uint64_t streamSize) {
+        ArchiveEntry& done = entries[idx];
+        done.dataSize = streamSize;
+        streampos end = out.tellp();
+        out.seekp((streamoff)(done.offset - 8));
+        out.write(reinterpret_cast<const char*>(&streamSize), 8);
+        out.seekp(end);
+        cout << "  + " << done.path << " (" << done.origSize << " → " << streamSize << ")\n";
+    };
+
+    string ext = fs::path(f.absPath).extension().string();
+    // Small entries are encoded both ways in one job and keep the shorter
+    // stream: for a few hundred bytes the KP06 header and block header can
+    // cost more than compression saves
+    const uint64_t SMALL_ENTRY = 64 * 1024;
+    if (origSize > 0 && origSize < SMALL_ENTRY) {
+        shared_ptr<const void> owner = map;
+        const uint8_t* bytes = map->valid() ? map->data() : nullptr;
+        if (!bytes) {
+            auto buffer = make_shared<vector<uint8_t>>((size_t)origSize);
+            in.read(reinterpret_cast<char*>(buffer->data()), (streamsize)origSize);
+            if ((uint64_t)in.gcount() != origSize) throw runtime_error("Input changed size while compressing.");
+            bytes = buffer->data();
+            owner = buffer;
+        }
+        e.crc32 = crc32Update(0, bytes, (size_t)origSize);
+        shared_future<vector<uint8_t>> encoded = pool.submit([owner, bytes, size = (size_t)origSize, ext, options]() {
+            vector<uint8_t> blocks = encodeBlockStream(bytes, size, ext, options);
+            vector<uint8_t> raw = encodeRawStream(bytes, size, ext);
+            return blocks.size() < raw.size() ? blocks : raw;
+        }).share();
+        writer.push([encoded]() { return encoded.get(); },
+                    [onDone](uint64_t, const vector<uint8_t>& stream) { onDone(stream.size()); });
+        return;
+    }
+    // blocks pick their own mode, so only empty files skip the block stream
+    if (map->valid()) {
+        e.crc32 = queueBlockStream(writer, pool, map, map->data(), origSize, ext, options, onDone);
+    } else if (origSize == 0) {
+        e.crc32 = queueRawStream(writer, in, origSize, ext, onDone);
+    } else {
+        e.crc32 = queueBlockStream(writer, pool, in, origSize, ext, options, onDone);
+    }
+}
+
+// Chunk store modes. Dedup cuts every input into content-defined chunks and
+// stores only chunks not seen before; solid appends whole inputs, so small
+// files share block history and Huffman tables. Solid mode feeds inputs
+// grouped by extension, since similar files compress best side by side;
+// inputs that look incompressible stay out of the store as ordinary entries.
+static void queueStoreEntries(OrderedWriter& writer, ThreadPool& pool, ostream& out, ChunkStoreWriter& store,
+                              const vector<ArchiveInput>& files, vector<ArchiveEntry>& entries,
+                              const CompressOptions& options) {
+    const size_t READ_CHUNK = 4 << 20;
+    vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    if (options.solid) {
+        auto typeOf = [&files](size_t i) {
+            string ext = fs::path(files[i].relPath).extension().string();
+            transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)tolower(c); });
+            return ext;
+        };
+        stable_sort(order.begin(), order.end(), [&typeOf](size_t a, size_t b) { return typeOf(a) < typeOf(b); });
+    }
+
+    vector<uint8_t> window;
+    for (size_t i : order) {
+        const ArchiveInput& f = files[i];
+        MappedFile map(f.absPath);
+        if (!options.dedup && map.valid() && sampleEntropy(map.data(), (size_t)map.size()) >= ENTROPY_SKIP_THRESHOLD) {
+            queueEntry(writer, pool, out, f, options, entries, i);
+            continue;
+        }
+
+        ArchiveEntry& e = entries[i];
+        e.path = f.relPath;
+        e.flags = ARCHIVE_ENTRY_COMPRESSED | (options.dedup ? ARCHIVE_ENTRY_CHUNKED : ARCHIVE_ENTRY_SOLID);
+        e.mtime = toUnixTime(fs::last_write_time(f.absPath));
+
+        uint64_t fresh = 0;
+        // returns how many bytes were consumed; the rest waits for more input
+        auto addBytes = [&](const uint8_t* data, size_t size, bool last) -> size_t {
+            if (!options.dedup) {
+                store.append(data, size);
+                e.crc32 = crc32Update(e.crc32, data, size);
+                fresh += size;
+                return size;
+            }
+            size_t used = 0;
+            while (used < size && (last || size - used >= CDC_MAX_CHUNK)) {
+                size_t len = findChunkBoundary(data + used, size - used);
+                bool isNew = false;
+                e.chunks.push_back(store.add(data + used, len, isNew));
+                e.crc32 = crc32Update(e.crc32, data + used, len);
+                if (isNew) fresh += len;
+                used += len;
+            }
+            return used;
+        };
+
+        if (!options.dedup) e.offset = store.size();
+        if (map.valid()) {
+            e.origSize = map.size();
+            addBytes(map.data(), (size_t)map.size(), true);
+        } else {
+            ifstream in(f.absPath, ios::binary);
+            if (!in) throw runtime_error("Cannot open input: " + f.absPath);
+            window.clear();
+            bool eof = false;
+            while (!eof) {
+                size_t have = window.size();
+                window.resize(have + READ_CHUNK);
+                in.read(reinterpret_cast<char*>(window.data() + have), READ_CHUNK);
+                window.resize(have + (size_t)in.gcount());
+                eof = !in;
+                e.origSize += (uint64_t)in.gcount();
+                size_t used = addBytes(window.data(), window.size(), eof);
+                window.erase(window.begin(), window.begin() + used);
+            }
+        }
+        if (options.dedup) cout << "  + " << e.path << " (" << e.origSize << ", " << fresh << " new)\n";
+        else cout << "  + " << e.path << " (" << e.origSize << ")\n";
+    }
+    store.finish();
+}
+
+void createArchive(const vector<string>& inputs, const string& outputArchive,
+                   const CompressOptions& options) {
     vector<ArchiveInput> files;
     for (auto& in : inputs)
         gatherFiles(fs::absolute(in).parent_path(), fs::absolute(in), files);
@@ -31,95 +277,466 @@ void createArchive(const vector<string>& inputs, const string& outputArchive) {
     ofstream out(outputArchive, ios::binary);
     if (!out) throw runtime_error("Cannot open output archive");
 
+    // Every entry's blocks go through one shared pool; the writer commits
+    // them in entry order, so at most a few blocks per worker are in memory
+    size_t threads = ThreadPool::resolveThreadCount(options.threads);
+    ThreadPool pool(threads);
+    OrderedWriter writer(out, threads * 2);
+
     // header
-    out.write(KITTY_MAGIC_V4.c_str(), KITTY_MAGIC_V4.size());
-    uint8_t ver = 4;
-    out.write(reinterpret_cast<char*>(&ver), 1);
+    vector<uint8_t> header(KITTY_MAGIC_V4.begin(), KITTY_MAGIC_V4.end());
+    bool useStore = options.dedup || options.solid;
+    header.push_back(useStore ? ARCHIVE_VERSION_STORE : ARCHIVE_VERSION);
     uint32_t count = (uint32_t)files.size();
-    out.write(reinterpret_cast<char*>(&count), 4);
+    appendBytes(header, &count, 4);
+    writer.push(move(header));
+
+    cout << "Creating " << (options.dedup ? "deduplicated " : options.solid ? "solid " : "")
+         << "archive with " << count << " file(s)\n";
+
+    vector<ArchiveEntry> entries(files.size());
+    if (useStore) {
+        ChunkStoreWriter store(writer, pool, options);
+        queueStoreEntries(writer, pool, out, store, files, entries, options);
+        writer.push([&entries, &writer, &store]() { return encodeDirectory(entries, writer.offset(), &store); });
+        writer.drain();
+    } else {
+        // stream entries
+        for (size_t i = 0; i < files.size(); ++i)
+            queueEntry(writer, pool, out, files[i], options, entries, i);
+
+        // central directory + footer, once every entry's offset and size is known
+        writer.push([&entries, &writer]() { return encodeDirectory(entries, writer.offset()); });
+        writer.drain();
+    }
+
+    out.close();
+    if (!out) throw runtime_error("Failed writing output archive");
+    cout << "Archive created: " << outputArchive << endl;
+}
+
+void updateArchive(const vector<string>& inputs, const string& archivePath,
+                   const CompressOptions& options, const ArchiveUpdateOptions& update) {
+    vector<ArchiveInput> files;
+    for (auto& in : inputs)
+        gatherFiles(fs::absolute(in).parent_path(), fs::absolute(in), files);
+
+    fstream io(archivePath, ios::in | ios::out | ios::binary);
+    if (!io) throw runtime_error("Cannot open archive");
+    ArchiveDirectory dir = readArchiveDirectory(io);
+    if (dir.version < ARCHIVE_VERSION)
+        throw runtime_error("Archive version " + to_string(dir.version) + " has no directory to update; recreate it.");
+    if (dir.version == ARCHIVE_VERSION_STORE)
+        throw runtime_error("Archives made with --dedup or --solid cannot be updated; recreate them.");
+    vector<ArchiveEntry>& entries = dir.entries;
 
-    cout << "Creating archive with " << count << " file(s)\n";
+    // New payloads go after the old footer, so the old directory stays
+    // valid until the new one is complete. Bytes past dir.end (left by an
+    // interrupted update) are unreferenced and get overwritten.
+    const uint64_t appendAt = dir.end;
+    unordered_map<string, size_t> byPath;
+    for (size_t i = 0; i < entries.size(); ++i) byPath[entries[i].path] = i;
 
-    // stream entries
+    // Decide what to (re)write
+    vector<ArchiveInput> pending;
+    vector<long long> replaces;   // index into entries, or -1 for a new entry
     for (auto& f : files) {
-        ifstream in(f.absPath, ios::binary);
-        if (!in) throw runtime_error("Cannot open input: " + f.absPath);
+        auto it = byPath.find(f.relPath);
+        if (it != byPath.end() && update.onlyChanged) {
+            const ArchiveEntry& old = entries[it->second];
+            bool same = old.origSize == (uint64_t)fs::file_size(f.absPath) &&
+                        (update.compareChecksum ? fileCrc32(f.absPath) == old.crc32
+                                                : toUnixTime(fs::last_write_time(f.absPath)) == old.mtime);
+            if (same) continue;
+        }
+        pending.push_back(f);
+        replaces.push_back(it != byPath.end() ? (long long)it->second : -1);
+    }
+
+    if (pending.empty()) {
+        cout << "Archive is up to date (" << entries.size() << " file(s))\n";
+        return;
+    }
+    cout << "Updating archive: " << pending.size() << " of " << files.size() << " file(s) changed or new\n";
 
-        vector<uint8_t> data((istreambuf_iterator<char>(in)),
-                              istreambuf_iterator<char>());
-        in.close();
+    size_t threads = ThreadPool::resolveThreadCount(options.threads);
+    ThreadPool pool(threads);
+    io.seekp((streamoff)appendAt);
+    OrderedWriter writer(io, threads * 2, appendAt);
 
-        // compress to temporary file buffer using existing API
-        string tmpOut = f.absPath + ".tmpkitty";
-        compressFile(f.absPath, tmpOut);  // produces KP03 per file
+    vector<ArchiveEntry> added(pending.size());
+    for (size_t i = 0; i < pending.size(); ++i)
+        queueEntry(writer, pool, io, pending[i], options, added, i);
 
-        ifstream comp(tmpOut, ios::binary);
-        vector<uint8_t> stored((istreambuf_iterator<char>(comp)),
-                                istreambuf_iterator<char>());
-        comp.close();
-        fs::remove(tmpOut);
+    // Directory: old entries in place (replaced ones pointing at their new
+    // payload), new entries at the end
+    writer.push([&]() {
+        vector<ArchiveEntry> merged = entries;
+        for (size_t i = 0; i < added.size(); ++i) {
+            if (replaces[i] >= 0) merged[(size_t)replaces[i]] = added[i];
+            else merged.push_back(added[i]);
+        }
+        entries.swap(merged);
+        return encodeDirectory(entries, writer.offset());
+    });
+    writer.drain();
 
-        bool isCompressed = true; // handled in compressFile
-        uint16_t pathLen = (uint16_t)f.relPath.size();
-        uint8_t flags = 1; // compressed flag
-        uint64_t origSize = data.size();
-        uint64_t dataSize = stored.size();
+    uint32_t count = (uint32_t)entries.size();
+    io.seekp(5);
+    io.write(reinterpret_cast<const char*>(&count), 4);
+    uint64_t end = writer.offset();
+    io.close();
+    if (!io) throw runtime_error("Failed writing archive");
+    if (fs::file_size(archivePath) > end) fs::resize_file(archivePath, end);  // drop what an interrupted update left
 
-        out.write(reinterpret_cast<char*>(&pathLen), 2);
-        out.write(f.relPath.c_str(), pathLen);
-        out.write(reinterpret_cast<char*>(&flags), 1);
-        out.write(reinterpret_cast<char*>(&origSize), 8);
-        out.write(reinterpret_cast<char*>(&dataSize), 8);
-        out.write(reinterpret_cast<char*>(stored.data()), dataSize);
+    cout << "Archive updated: " << archivePath << " (" << count << " file(s))\n";
+}
 
-        cout << "  + " << f.relPath << " (" << origSize << " → "
-             << dataSize << ")\n";
+// Version 4 archives have no directory: walk the local headers, seeking
+// over each payload
+static vector<ArchiveEntry> scanEntries(istream& in, uint32_t count) {
+    vector<ArchiveEntry> entries(count);
+    for (auto& e : entries) {
+        uint16_t pathLen = 0;
+        in.read(reinterpret_cast<char*>(&pathLen), 2);
+        e.path.assign(pathLen, '\0');
+        in.read(&e.path[0], pathLen);
+        in.read(reinterpret_cast<char*>(&e.flags), 1);
+        in.read(reinterpret_cast<char*>(&e.origSize), 8);
+        in.read(reinterpret_cast<char*>(&e.dataSize), 8);
+        if (!in) throw runtime_error("Corrupted archive entry header.");
+        e.flags &= ~ARCHIVE_ENTRY_HAS_CRC;
+        e.offset = (uint64_t)in.tellg();
+        in.seekg((streamoff)(e.offset + e.dataSize));
     }
+    return entries;
+}
 
-    out.close();
-    cout << "Archive created: " << outputArchive << endl;
+const uint64_t ARCHIVE_FOOTER_SIZE = 16;   // dirOffset u64, count u32, "KPCD"
+
+// Parses the directory whose footer ends at end into result (version set)
+static void readDirectoryAt(istream& in, uint64_t end, ArchiveDirectory& result) {
+    in.clear();
+    if (end < 9 + ARCHIVE_FOOTER_SIZE) throw runtime_error("Missing archive directory.");
+    uint8_t footer[ARCHIVE_FOOTER_SIZE];
+    in.seekg((streamoff)(end - ARCHIVE_FOOTER_SIZE));
+    in.read(reinterpret_cast<char*>(footer), ARCHIVE_FOOTER_SIZE);
+    uint64_t dirOffset; memcpy(&dirOffset, footer, 8);
+    uint32_t dirCount; memcpy(&dirCount, footer + 8, 4);
+    if (!in || memcmp(footer + 12, "KPCD", 4) != 0 || dirOffset < 9 || dirOffset > end - ARCHIVE_FOOTER_SIZE)
+        throw runtime_error("Corrupted archive directory footer.");
+
+    vector<uint8_t> dir((size_t)(end - ARCHIVE_FOOTER_SIZE - dirOffset));
+    in.seekg((streamoff)dirOffset);
+    in.read(reinterpret_cast<char*>(dir.data()), dir.size());
+    if (!in) throw runtime_error("Truncated archive directory.");
+
+    vector<ArchiveEntry>& entries = result.entries;
+    entries.clear();
+    entries.resize(dirCount);
+    size_t pos = 0;
+    auto take = [&](void* dst, size_t n) {
+        if (pos + n > dir.size()) throw runtime_error("Corrupted archive directory.");
+        memcpy(dst, dir.data() + pos, n);
+        pos += n;
+    };
+    for (auto& e : entries) {
+        uint16_t pathLen = 0;
+        take(&pathLen, 2);
+        e.path.assign(pathLen, '\0');
+        take(&e.path[0], pathLen);
+        take(&e.flags, 1);
+        take(&e.offset, 8);
+        take(&e.origSize, 8);
+        take(&e.dataSize, 8);
+        take(&e.crc32, 4);
+        take(&e.mtime, 8);
+        e.flags |= ARCHIVE_ENTRY_HAS_CRC;
+        if (!(e.flags & ARCHIVE_ENTRY_SOLID) && e.offset + e.dataSize > dirOffset)
+            throw runtime_error("Corrupted archive directory entry.");
+        if (e.flags & ARCHIVE_ENTRY_CHUNKED) {
+            uint32_t n = 0;
+            take(&n, 4);
+            if (n > dir.size() / 4) throw runtime_error("Corrupted archive directory.");
+            e.chunks.resize(n);
+            if (n > 0) take(e.chunks.data(), (size_t)n * 4);   // empty files have no chunks
+        }
+    }
+    result.chunks.clear();
+    result.storeBlocks.clear();
+    if (result.version == ARCHIVE_VERSION_STORE) {
+        uint32_t n = 0;
+        take(&n, 4);
+        if (n > dir.size() / 28) throw runtime_error("Corrupted archive directory.");
+        result.chunks.resize(n);
+        for (auto& c : result.chunks) {
+            take(&c.storeOffset, 8);
+            take(&c.size, 4);
+            take(&c.hash.lo, 8);
+            take(&c.hash.hi, 8);
+        }
+        take(&n, 4);
+        if (n > dir.size() / 16) throw runtime_error("Corrupted archive directory.");
+        result.storeBlocks.resize(n);
+        for (auto& b : result.storeBlocks) {
+            take(&b.offset, 8);
+            take(&b.compressedSize, 4);
+            take(&b.rawSize, 4);
+            if (b.offset + b.compressedSize > dirOffset) throw runtime_error("Corrupted chunk store block table.");
+        }
+    }
+    if (pos != dir.size()) throw runtime_error("Corrupted archive directory.");
+    result.end = end;
 }
 
-void extractArchive(const string& archivePath, const string& outputFolder) {
-    ifstream in(archivePath, ios::binary);
-    if (!in) throw runtime_error("Cannot open archive");
+// An update that died before writing its new footer leaves payloads (and
+// perhaps part of a directory) after the previous footer. Finds the last
+// footer before fileSize whose directory reads back.
+static bool readPreviousDirectory(istream& in, uint64_t fileSize, ArchiveDirectory& result) {
+    const uint64_t WINDOW = 1 << 20;
+    vector<uint8_t> buf;
+    for (uint64_t hi = fileSize - 1; hi > 9 + ARCHIVE_FOOTER_SIZE;) {   // footers ending before fileSize
+        uint64_t lo = hi > 9 + WINDOW ? hi - WINDOW : 9;
+        buf.resize((size_t)(hi - lo));
+        in.clear();
+        in.seekg((streamoff)lo);
+        in.read(reinterpret_cast<char*>(buf.data()), buf.size());
+        if (!in) return false;
+        for (size_t i = buf.size(); i-- >= 4;) {
+            if (memcmp(&buf[i - 3], "KPCD", 4) != 0) continue;
+            try {
+                readDirectoryAt(in, lo + i + 1, result);
+                return true;
+            } catch (const runtime_error&) {
+            }
+        }
+        hi = lo + 3;   // a magic may straddle the window edge
+        if (lo == 9) break;
+    }
+    return false;
+}
+
+ArchiveDirectory readArchiveDirectory(istream& in) {
+    in.clear();
+    in.seekg(0, ios::end);
+    uint64_t fileSize = (uint64_t)in.tellg();
+    in.seekg(0);
 
     string magic(4, '\0');
     in.read(&magic[0], 4);
-    if (magic != KITTY_MAGIC_V4)
+    if (!in || magic != KITTY_MAGIC_V4)
         throw runtime_error("Not a KP04 archive");
+    uint8_t ver = 0; in.read(reinterpret_cast<char*>(&ver), 1);
+    uint32_t count = 0; in.read(reinterpret_cast<char*>(&count), 4);
+    if (!in) throw runtime_error("Corrupted archive header.");
+    ArchiveDirectory result;
+    result.version = ver;
+    if (ver < 5) {
+        result.entries = scanEntries(in, count);
+        result.end = fileSize;
+        return result;
+    }
+    if (ver > ARCHIVE_VERSION_STORE) throw runtime_error("Unsupported archive version " + to_string(ver) + ".");
 
-    uint8_t ver; in.read(reinterpret_cast<char*>(&ver), 1);
-    uint32_t count; in.read(reinterpret_cast<char*>(&count), 4);
+    try {
+        readDirectoryAt(in, fileSize, result);
+    } catch (const runtime_error&) {
+        if (!readPreviousDirectory(in, fileSize, result)) throw;
+        cout << "Warning: archive ends in an interrupted update; using the directory from before it.\n";
+    }
+    return result;
+}
 
-    cout << "Extracting " << count << " file(s)\n";
+void listArchive(const string& archivePath) {
+    ifstream in(archivePath, ios::binary);
+    if (!in) throw runtime_error("Cannot open archive");
+    ArchiveDirectory dir = readArchiveDirectory(in);
+    const vector<ArchiveEntry>& entries = dir.entries;
 
-    for (uint32_t i = 0; i < count; ++i) {
-        uint16_t pathLen; in.read(reinterpret_cast<char*>(&pathLen), 2);
-        string rel(pathLen, '\0'); in.read(&rel[0], pathLen);
-        uint8_t flags; in.read(reinterpret_cast<char*>(&flags), 1);
-        uint64_t origSize, dataSize;
-        in.read(reinterpret_cast<char*>(&origSize), 8);
-        in.read(reinterpret_cast<char*>(&dataSize), 8);
+    uint64_t totalOrig = 0, totalData = 0;
+    for (auto& b : dir.storeBlocks) totalData += b.compressedSize;
+    cout << setw(12) << "Size" << setw(12) << "Packed" << "  " << setw(19) << left << "Modified" << right
+         << "  CRC32     Name\n";
+    for (auto& e : entries) {
+        cout << setw(12) << e.origSize;
+        if (e.flags & ARCHIVE_ENTRY_CHUNKED) cout << setw(12) << "chunked" << "  ";
+        else if (e.flags & ARCHIVE_ENTRY_SOLID) cout << setw(12) << "solid" << "  ";
+        else cout << setw(12) << e.dataSize << "  ";
+        if (e.flags & ARCHIVE_ENTRY_HAS_CRC) {
+            time_t t = (time_t)e.mtime;
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            cout << when << "  " << hex << setw(8) << setfill('0') << e.crc32 << dec << setfill(' ');
+        } else {
+            cout << setw(19) << "-" << "  " << setw(8) << "-";
+        }
+        cout << "  " << e.path << "\n";
+        totalOrig += e.origSize;
+        totalData += e.dataSize;
+    }
+    cout << setw(12) << totalOrig << setw(12) << totalData << "  " << entries.size() << " file(s)";
+    if (dir.version == ARCHIVE_VERSION_STORE) {
+        cout << ", " << dir.storeBlocks.size() << " store block(s)";
+        if (!dir.chunks.empty()) cout << " holding " << dir.chunks.size() << " unique chunk(s)";
+    }
+    cout << "\n";
+}
 
-        vector<uint8_t> buf(dataSize);
-        in.read(reinterpret_cast<char*>(buf.data()), dataSize);
+// Glob match on '/'-separated paths: '*' stays within one path segment,
+// '**' crosses segments, '?' matches one non-separator character
+static bool globMatch(const char* p, const char* s) {
+    for (; *p; ++p, ++s) {
+        if (*p == '*') {
+            bool deep = p[1] == '*';
+            while (*p == '*') ++p;
+            for (;; ++s) {
+                if (globMatch(p, s)) return true;
+                if (!*s || (!deep && *s == '/')) return false;
+            }
+        }
+        if (!*s || (*p == '?' ? *s == '/' : *p != *s)) return false;
+    }
+    return !*s;
+}
 
-        fs::path outPath = fs::path(outputFolder) / rel;
-        fs::create_directories(outPath.parent_path());
+static string normalizePath(string path) {
+    replace(path.begin(), path.end(), '\\', '/');
+    return path;
+}
 
-        // Write buffer to temp .kitty, then decompressFile()
-        string tmp = outPath.string() + ".tmpkitty";
-        ofstream tmpf(tmp, ios::binary);
-        tmpf.write(reinterpret_cast<char*>(buf.data()), dataSize);
-        tmpf.close();
+// A pattern selects an entry if it matches the whole path, or names a
+// directory the entry lives under
+static bool entrySelected(const string& path, const vector<string>& patterns) {
+    if (patterns.empty()) return true;
+    string p = normalizePath(path);
+    for (auto& raw : patterns) {
+        string pat = normalizePath(raw);
+        while (pat.size() > 1 && pat.back() == '/') pat.pop_back();
+        if (globMatch(pat.c_str(), p.c_str())) return true;
+        if (p.size() > pat.size() && p[pat.size()] == '/' && globMatch(pat.c_str(), p.substr(0, pat.size()).c_str()))
+            return true;
+    }
+    return false;
+}
 
-        decompressFile(tmp, outPath.string());
-        fs::remove(tmp);
+// in is the caller's handle on the archive; store reads from the same
+// handle and is only needed for chunk store entries
+static void extractEntry(istream& in, ChunkStoreReader* store, const ArchiveEntry& e,
+                         const string& outputFolder, const DecompressOptions& options) {
+    fs::path outPath = fs::path(outputFolder) / e.path;
+    fs::create_directories(outPath.parent_path());
+
+    uint32_t crc = 0;
+    if (e.flags & (ARCHIVE_ENTRY_CHUNKED | ARCHIVE_ENTRY_SOLID)) {
+        // Reassemble from the chunk store, checksumming as the bytes go out
+        if (!store) throw runtime_error("Corrupted archive directory entry.");
+        OutputFile out(outPath.string());
+        uint64_t pos = 0;
+        auto emit = [&](const uint8_t* data, size_t len) {
+            out.writeAt(pos, data, len);
+            crc = crc32Update(crc, data, len);
+            pos += len;
+        };
+        if (e.flags & ARCHIVE_ENTRY_SOLID) {
+            store->readRange(e.offset, e.origSize, emit);
+        } else {
+            vector<uint8_t> chunk;
+            for (uint32_t id : e.chunks) {
+                store->read(id, chunk);
+                emit(chunk.data(), chunk.size());
+            }
+        }
+        out.close();
+        if (pos != e.origSize) throw runtime_error("Size mismatch in " + e.path);
+    } else {
+        // Decode straight from the archive at the entry's recorded offset
+        in.clear();
+        in.seekg((streamoff)e.offset);
+        decompressToFile(in, outPath.string(), options);
+        if (e.flags & ARCHIVE_ENTRY_HAS_CRC) crc = fileCrc32(outPath.string());
+    }
+
+    if (e.flags & ARCHIVE_ENTRY_HAS_CRC) {
+        if (crc != e.crc32)
+            throw runtime_error("CRC mismatch in " + e.path);
+        fs::last_write_time(outPath, fromUnixTime(e.mtime));
+    }
+}
+
+void extractArchive(const string& archivePath, const string& outputFolder,
+                    const DecompressOptions& options, const vector<string>& patterns) {
+    const uint64_t LARGE_ENTRY = 4 << 20;   // decoded alone, with block-level parallelism
+    ArchiveDirectory dir;
+    vector<ArchiveEntry> selected;
+    {
+        ifstream in(archivePath, ios::binary);
+        if (!in) throw runtime_error("Cannot open archive");
+        dir = readArchiveDirectory(in);
+        for (auto& e : dir.entries)
+            if (entrySelected(e.path, patterns)) selected.push_back(e);
+    }
+    if (!patterns.empty() && selected.empty()) throw runtime_error("No entries match the given patterns.");
+
+    cout << "Extracting " << selected.size() << " file(s)\n";
+
+    // Work is split into groups, each decoded by one worker on its own
+    // archive handle. Small entries form a group each. Chunk store entries
+    // are grouped by the store block they start in, so every block is
+    // decoded once however many small files it holds.
+    vector<vector<const ArchiveEntry*>> groups;
+    vector<const ArchiveEntry*> large;
+    {
+        vector<uint64_t> blockStart;
+        uint64_t at = 0;
+        for (auto& b : dir.storeBlocks) { blockStart.push_back(at); at += b.rawSize; }
+        auto startBlock = [&](const ArchiveEntry& e) -> size_t {
+            uint64_t pos = e.offset;
+            if (e.flags & ARCHIVE_ENTRY_CHUNKED)
+                pos = e.chunks.empty() || e.chunks[0] >= dir.chunks.size() ? 0 : dir.chunks[e.chunks[0]].storeOffset;
+            return (size_t)(upper_bound(blockStart.begin(), blockStart.end(), pos) - blockStart.begin());
+        };
+        map<size_t, size_t> groupOfBlock;
+        for (auto& e : selected) {
+            if (e.flags & (ARCHIVE_ENTRY_CHUNKED | ARCHIVE_ENTRY_SOLID)) {
+                auto it = groupOfBlock.emplace(startBlock(e), groups.size()).first;
+                if (it->second == groups.size()) groups.emplace_back();
+                groups[it->second].push_back(&e);
+            } else if (e.origSize >= LARGE_ENTRY) {
+                large.push_back(&e);
+            } else {
+                groups.push_back({ &e });
+            }
+        }
+    }
+
+    size_t threads = ThreadPool::resolveThreadCount(options.threads);
+    DecompressOptions single = options;
+    single.threads = 1;
+    mutex logMutex;
+    {
+        ThreadPool pool(threads);
+        vector<future<void>> jobs;
+        for (auto& group : groups) {
+            jobs.push_back(pool.submit([&archivePath, &dir, &group, &outputFolder, &single, &logMutex]() {
+                ifstream in(archivePath, ios::binary);
+                if (!in) throw runtime_error("Cannot open archive");
+                ChunkStoreReader store(in, dir.chunks, dir.storeBlocks, single.dictionary.get());
+                for (const ArchiveEntry* e : group) {
+                    extractEntry(in, &store, *e, outputFolder, single);
+                    lock_guard<mutex> lock(logMutex);
+                    cout << "  Done " << e->path << " (" << e->origSize << " bytes)\n";
+                }
+            }));
+        }
+        for (auto& job : jobs) job.get();
+    }
 
-        cout << "  Done " << rel << " (" << origSize << " bytes)\n";
+    for (const ArchiveEntry* e : large) {
+        ifstream in(archivePath, ios::binary);
+        if (!in) throw runtime_error("Cannot open archive");
+        extractEntry(in, nullptr, *e, outputFolder, options);
+        cout << "  Done " << e->path << " (" << e->origSize << " bytes)\n";
     }
 
-    in.close();
     cout << "Extraction finished → " << outputFolder << endl;
 }
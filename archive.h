@@ -1,7 +1,51 @@
 //archive.h
 #pragma once
+#include <cstdint>
+#include <istream>
 #include <string>
 #include <vector>
+#include "huffman.h"
+#include "dedup.h"
+
+// KP04 archive: "KP04", ver u8, entry count u32, then per entry a local
+// header (pathLen u16, path, flags u8, origSize u64, dataSize u64) followed
+// by the entry's .kitty stream.
+// Version 5 appends a central directory (one record per entry: pathLen u16,
+// path, flags u8, offset u64, origSize u64, dataSize u64, crc32 u32, mtime i64)
+// and a footer (dirOffset u64, count u32, "KPCD"), so entries can be listed
+// and reached without reading the payloads.
+// Version 6 (--dedup, --solid) has no per-entry payloads: a chunk store of
+// KP06 blocks follows the header. Chunked entries list their chunk ids after
+// their directory record (count u32, ids u32); solid entries keep their
+// offset in the uncompressed store in offset. The directory ends with
+// the chunk table (count u32; storeOffset u64, size u32, 16 bytes of the
+// chunk's SHA-256) and the store's block table (count u32; offset u64, compressedSize u32,
+// rawSize u32) before the footer.
+const uint8_t ARCHIVE_VERSION = 5;
+const uint8_t ARCHIVE_VERSION_STORE = 6;
+const uint8_t ARCHIVE_ENTRY_COMPRESSED = 0x01;
+const uint8_t ARCHIVE_ENTRY_CHUNKED = 0x02;   // content is a list of chunk store chunks
+const uint8_t ARCHIVE_ENTRY_SOLID = 0x04;     // content is a contiguous range of the chunk store
+const uint8_t ARCHIVE_ENTRY_HAS_CRC = 0x80;   // in-memory only: crc32/mtime are known (version 5)
+
+struct ArchiveEntry {
+    std::string path;
+    uint8_t flags = 0;
+    uint64_t offset = 0;     // of the entry's .kitty stream
+    uint64_t origSize = 0;
+    uint64_t dataSize = 0;
+    uint32_t crc32 = 0;      // of the original bytes
+    int64_t mtime = 0;       // seconds since the Unix epoch
+    std::vector<uint32_t> chunks;  // chunk ids, in order (ARCHIVE_ENTRY_CHUNKED)
+};
+
+struct ArchiveDirectory {
+    uint8_t version = 0;
+    std::vector<ArchiveEntry> entries;
+    std::vector<DedupChunk> chunks;             // version 6
+    std::vector<BlockIndexEntry> storeBlocks;   // version 6
+    uint64_t end = 0;                           // just past the footer; any bytes after it are unreferenced
+};
 
 struct ArchiveInput {
     std::string absPath;  // actual disk path
@@ -9,7 +53,34 @@ struct ArchiveInput {
 };
 
 void createArchive(const std::vector<std::string>& inputs,
-                   const std::string& outputArchive);
+                   const std::string& outputArchive,
+                   const CompressOptions& options = CompressOptions());
 
+struct ArchiveUpdateOptions {
+    bool onlyChanged = true;        // skip inputs whose entry is unchanged (update); false rewrites them all (add)
+    bool compareChecksum = false;   // detect changes by CRC-32 instead of size + mtime
+};
+
+// Appends new and changed inputs to an existing version 5 archive. Unchanged
+// payloads stay where they are; new payloads and then a new directory go
+// after the old footer, so until the new footer is written the old
+// directory still describes the archive. Replaced entries and the old
+// directory are left behind as dead space.
+void updateArchive(const std::vector<std::string>& inputs,
+                   const std::string& archivePath,
+                   const CompressOptions& options = CompressOptions(),
+                   const ArchiveUpdateOptions& update = ArchiveUpdateOptions());
+
+// Extracts the entries matching any of patterns (all entries if empty).
+// Patterns are globs over archive paths ('*', '**', '?'); a plain
+// directory path selects everything below it.
 void extractArchive(const std::string& archivePath,
-                    const std::string& outputFolder);
+                    const std::string& outputFolder,
+                    const DecompressOptions& options = DecompressOptions(),
+                    const std::vector<std::string>& patterns = std::vector<std::string>());
+
+// Entry table of an archive: read from the directory (version 5+) or by
+// walking the local headers (version 4)
+ArchiveDirectory readArchiveDirectory(std::istream& in);
+
+void listArchive(const std::string& archivePath);
@@ -1,17 +1,28 @@
 // bitstream.cpp
 #include "bitstream.h"
 #include <iostream>
+#include <algorithm>
 
-BitWriter::BitWriter(std::ostream &stream) : out(stream), buffer(0), bitCount(0) {}
+BitWriter::BitWriter(std::ostream &stream)
+    : out(&stream), sink(nullptr), blockPos(0), bitBuf(0), bitCount(0) {
+    block.resize(64 * 1024);
+}
 
-void BitWriter::writeBit(bool bit) {
-    buffer = (buffer << 1) | (bit ? 1 : 0);
-    bitCount++;
-    if (bitCount == 8) {
-        out.write(reinterpret_cast<const char*>(&buffer), 1);
-        bitCount = 0;
-        buffer = 0;
+BitWriter::BitWriter(std::vector<uint8_t> &target)
+    : out(nullptr), sink(&target), blockPos(0), bitBuf(0), bitCount(0) {
+    block.resize(64 * 1024);
+}
+
+void BitWriter::flushBlock() {
+    if (blockPos > 0) {
+        if (sink) sink->insert(sink->end(), block.begin(), block.begin() + blockPos);
+        else out->write(reinterpret_cast<const char*>(block.data()), blockPos);
     }
+    blockPos = 0;
+}
+
+void BitWriter::writeBit(bool bit) {
+    writeBits(bit ? 1 : 0, 1);
 }
 
 void BitWriter::writeBits(const std::string &bits) {
@@ -19,27 +30,60 @@ void BitWriter::writeBits(const std::string &bits) {
 }
 
 void BitWriter::flush() {
+    if (blockPos + 8 > block.size()) flushBlock();
+    while (bitCount >= 8) {
+        bitCount -= 8;
+        block[blockPos++] = uint8_t(bitBuf >> bitCount);
+    }
     if (bitCount > 0) {
-        buffer <<= (8 - bitCount);
-        out.write(reinterpret_cast<const char*>(&buffer), 1);
+        block[blockPos++] = uint8_t(bitBuf << (8 - bitCount));
         bitCount = 0;
-        buffer = 0;
     }
+    bitBuf = 0;
+    flushBlock();
 }
 
 //BitReader
 
-BitReader::BitReader(std::istream &stream) : in(stream), buffer(0), bitCount(0) {}
+BitReader::BitReader(std::istream &stream, uint64_t maxBytes)
+    : in(&stream), cur(nullptr), end(nullptr), remaining(maxBytes),
+      bitBuf(0), bitCount(0), consumed(0), totalBits(UINT64_MAX) {
+    storage.resize(64 * 1024);
+}
+
+BitReader::BitReader(const uint8_t *data, size_t size)
+    : in(nullptr), cur(data), end(data + size), remaining(0),
+      bitBuf(0), bitCount(0), consumed(0), totalBits(UINT64_MAX) {}
 
-bool BitReader::readBit(bool &bit) {
-    if (bitCount == 0) {
-        if (!in.read(reinterpret_cast<char*>(&buffer), 1))
-            return false;
-        bitCount = 8;
+void BitReader::refillSlow() {
+    while (bitCount <= 56) {
+        if (cur == end) {
+            size_t got = 0;
+            if (in && remaining > 0) {
+                size_t want = (size_t)std::min<uint64_t>(storage.size(), remaining);
+                in->read(reinterpret_cast<char*>(storage.data()), (std::streamsize)want);
+                got = (size_t)in->gcount();
+                remaining -= got;
+                cur = storage.data();
+                end = cur + got;
+            }
+            if (got == 0) {
+                // input exhausted: remember where real data stops and pad with zeros
+                if (totalBits == UINT64_MAX) totalBits = consumed + bitCount;
+                bitCount = 64;
+                return;
+            }
+        }
+        bitBuf |= uint64_t(*cur++) << (56 - bitCount);
+        bitCount += 8;
     }
+}
+
+bool BitReader::readBit(bool &bit) {
+    refill();
+    if (consumed >= totalBits) return false;
     // Read MSB first
-    bit = (buffer & 0x80) != 0;
-    buffer <<= 1;
-    bitCount--;
+    bit = peekBits(1) != 0;
+    skipBits(1);
     return true;
 }
@@ -4,25 +4,89 @@
 #include <ostream>
 #include <cstdint>
 #include <string>
+#include <vector>
 
+// MSB-first bit writer. Bits collect in a 64-bit accumulator and leave it
+// 32 at a time into an internal block buffer that is written to the stream
+// (or appended to an in-memory sink) in large chunks.
 class BitWriter {
-    std::ostream &out;
-    uint8_t buffer;
-    int bitCount;
+    std::ostream *out;
+    std::vector<uint8_t> *sink;
+    std::vector<uint8_t> block;
+    size_t blockPos;
+    uint64_t bitBuf;      // pending bits, right-aligned
+    unsigned bitCount;
+
+    void flushBlock();
 
 public:
     BitWriter(std::ostream &stream);
+    BitWriter(std::vector<uint8_t> &sink);
     void writeBit(bool bit);
     void writeBits(const std::string &bits);
+
+    // Writes the low nbits of code, most significant first (nbits <= 32)
+    inline void writeBits(uint64_t code, unsigned nbits) {
+        bitBuf = (bitBuf << nbits) | code;
+        bitCount += nbits;
+        if (bitCount >= 32) {
+            if (blockPos + 4 > block.size()) flushBlock();
+            bitCount -= 32;
+            uint32_t w = uint32_t(bitBuf >> bitCount);
+            block[blockPos++] = uint8_t(w >> 24);
+            block[blockPos++] = uint8_t(w >> 16);
+            block[blockPos++] = uint8_t(w >> 8);
+            block[blockPos++] = uint8_t(w);
+        }
+    }
+
+    // Pads the last partial byte with zeros and writes everything buffered
     void flush();
 };
 
+// MSB-first bit reader backed by a 64-bit accumulator.
+// Reads either from an in-memory buffer or from a stream in large blocks
+// (optionally limited to maxBytes so it never reads past a payload).
+// Past the end of input the reader yields zero bits; overrun() reports it.
 class BitReader {
-    std::istream &in;
-    uint8_t buffer;
-    int bitCount;
+    std::istream *in;
+    std::vector<uint8_t> storage;
+    const uint8_t *cur;
+    const uint8_t *end;
+    uint64_t remaining;   // bytes still allowed to be pulled from the stream
+    uint64_t bitBuf;      // valid bits are left-aligned
+    unsigned bitCount;
+    uint64_t consumed;
+    uint64_t totalBits;   // known once input is exhausted
+
+    void refillSlow();
 
 public:
-    BitReader(std::istream &stream);
+    BitReader(std::istream &stream, uint64_t maxBytes = UINT64_MAX);
+    BitReader(const uint8_t *data, size_t size);
+
     bool readBit(bool &bit);
+
+    // Guarantees at least 57 bits are buffered (zero-padded past the end).
+    inline void refill() {
+        if (bitCount > 56) return;
+        if (end - cur >= 8) {
+            uint64_t w = (uint64_t(cur[0]) << 56) | (uint64_t(cur[1]) << 48) |
+                         (uint64_t(cur[2]) << 40) | (uint64_t(cur[3]) << 32) |
+                         (uint64_t(cur[4]) << 24) | (uint64_t(cur[5]) << 16) |
+                         (uint64_t(cur[6]) << 8)  |  uint64_t(cur[7]);
+            bitBuf |= w >> bitCount;
+            cur += (63 - bitCount) >> 3;
+            bitCount |= 56;
+        } else {
+            refillSlow();
+        }
+    }
+    // n must be in [1, 32] and not exceed the buffered bit count
+    inline uint32_t peekBits(unsigned n) const { return uint32_t(bitBuf >> (64 - n)); }
+    inline void skipBits(unsigned n) { bitBuf <<= n; bitCount -= n; consumed += n; }
+    inline unsigned bitsBuffered() const { return bitCount; }
+
+    uint64_t bitsConsumed() const { return consumed; }
+    bool overrun() const { return consumed > totalBits; }
 };
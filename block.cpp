@@ -0,0 +1,934 @@
+// block.cpp  (KP06 block encode/decode)
+#include "block.h"
+#include "lz77.h"
+#include "kitty.h"
+#include "checksum.h"
+#include "dictionary.h"
+#include "fse.h"
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+static void appendU32(vector<uint8_t> &out, uint32_t v) {
+    uint8_t b[4];
+    memcpy(b, &v, 4);
+    out.insert(out.end(), b, b + 4);
+}
+
+static uint32_t loadU32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void appendU64(vector<uint8_t> &out, uint64_t v) {
+    uint8_t b[8];
+    memcpy(b, &v, 8);
+    out.insert(out.end(), b, b + 8);
+}
+
+// magic, then the isCompressed/flags byte and the extension every .kitty stream carries
+static vector<uint8_t> streamPrologue(const string &magic, uint8_t flags, const string &ext) {
+    vector<uint8_t> out(magic.begin(), magic.end());
+    out.push_back(flags);
+    appendU64(out, ext.size());
+    out.insert(out.end(), ext.begin(), ext.end());
+    return out;
+}
+
+static void appendHeader(vector<uint8_t> &out, uint8_t mode, uint32_t rawSize, uint32_t payloadSize) {
+    out.push_back(mode);
+    appendU32(out, rawSize);
+    appendU32(out, payloadSize);
+}
+
+static void appendStored(const uint8_t *data, size_t size, vector<uint8_t> &out) {
+    appendHeader(out, BLOCK_STORED, (uint32_t)size, (uint32_t)size);
+    out.insert(out.end(), data, data + size);
+}
+
+static void storeU32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, 4);
+}
+
+// Cheap statistics taken before committing to the LZ77 pass: the byte
+// histogram, the size of a run-length coding, and how often sampled 4-byte
+// strings recur within the block (an estimate of what LZ77 can find)
+struct BlockStats {
+    vector<uint64_t> freq;
+    size_t rleSize = 0;       // BLOCK_RLE payload bytes
+    double repeats = 0;       // fraction of sampled strings seen earlier in the block
+};
+
+static size_t varintSize(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) { v >>= 7; ++n; }
+    return n;
+}
+
+static void appendVarint(vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) { out.push_back(uint8_t(v | 0x80)); v >>= 7; }
+    out.push_back(uint8_t(v));
+}
+
+static BlockStats measureBlock(const uint8_t *data, size_t size) {
+    const unsigned SAMPLE_SHIFT = 59;   // one position in 32, picked by content so repeats sample alike
+    const unsigned TABLE_BITS = 16;
+    BlockStats stats;
+    stats.freq.assign(256, 0);
+    vector<uint32_t> seen(size_t(1) << TABLE_BITS, 0);
+    uint64_t samples = 0, hits = 0;
+    size_t runStart = 0;
+    for (size_t i = 0; i < size; ++i) {
+        stats.freq[data[i]]++;
+        if (i > 0 && data[i] != data[i - 1]) {
+            stats.rleSize += 1 + varintSize(i - runStart - 1);
+            runStart = i;
+        }
+        if (i + 4 > size) continue;
+        uint32_t v;
+        memcpy(&v, data + i, 4);
+        uint64_t h = v * 0x9E3779B97F4A7C15ull;
+        if ((h >> SAMPLE_SHIFT) != 0) continue;
+        uint32_t &slot = seen[(h >> (SAMPLE_SHIFT - TABLE_BITS)) & ((1u << TABLE_BITS) - 1)];
+        uint32_t check = uint32_t(h >> 16) | 1;
+        ++samples;
+        if (slot == check) ++hits;
+        slot = check;
+    }
+    stats.rleSize += 1 + varintSize(size - runStart - 1);
+    stats.repeats = samples ? (double)hits / samples : 0.0;
+    return stats;
+}
+
+// Length of the run of data[0] starting at data (8 bytes at a time)
+static size_t runLength(const uint8_t *data, size_t size) {
+    const uint64_t pattern = 0x0101010101010101ull * data[0];
+    size_t run = 1;
+    for (uint64_t v; run + 8 <= size; run += 8) {
+        memcpy(&v, data + run, 8);
+        if (v != pattern) break;
+    }
+    while (run < size && data[run] == data[0]) ++run;
+    return run;
+}
+
+// BLOCK_RLE: {byte, varint run length - 1} pairs
+static void appendRle(const uint8_t *data, size_t size, vector<uint8_t> &out) {
+    const size_t headerAt = out.size();
+    appendHeader(out, BLOCK_RLE, (uint32_t)size, 0);
+    for (size_t i = 0; i < size;) {
+        size_t run = runLength(data + i, size - i);
+        out.push_back(data[i]);
+        appendVarint(out, run - 1);
+        i += run;
+    }
+    storeU32(&out[headerAt + 5], (uint32_t)(out.size() - headerAt - BLOCK_HEADER_SIZE));
+}
+
+// Fast mode limits BLOCK_HUFFMAN codes to this many bits, so two byte
+// pairs and a byte (55 bits) fit the encoder's accumulator at once and the
+// decoder needs one table lookup per byte
+static const unsigned FAST_HUFFMAN_BITS = 11;
+
+// Codes data[0..size) in BitWriter's bit layout, with codes[b] =
+// value << 4 | length. op needs 8 bytes of slack for the whole-word
+// stores; returns its new end.
+static uint8_t *encodeHuffmanBytes(const uint8_t *data, size_t size, const uint32_t *codes, unsigned maxLength,
+                                   uint8_t *op) {
+    uint64_t acc = 0;
+    unsigned count = 0;
+    auto put = [&](uint32_t value, unsigned length) { acc = (acc << length) | value; count += length; };
+    auto flush = [&]() {   // count > 0
+        uint64_t w = __builtin_bswap64(acc << (64 - count));
+        memcpy(op, &w, 8);
+        op += count >> 3;
+        count &= 7;
+    };
+    size_t i = 0;
+    if (maxLength <= FAST_HUFFMAN_BITS && size >= 65536) {
+        // Two bytes per lookup halve the serial shift/or chain through acc;
+        // pairs[x << 8 | y] = (code x, code y) << 5 | combined length
+        vector<uint32_t> pairs(65536);
+        for (uint32_t x = 0; x < 256; ++x)
+            for (uint32_t y = 0; y < 256; ++y) {
+                uint32_t cx = codes[x], cy = codes[y];
+                pairs[x << 8 | y] = ((((cx >> 4) << (cy & 15)) | (cy >> 4)) << 5) | ((cx & 15) + (cy & 15));
+            }
+        for (; i + 5 <= size; i += 5) {
+            uint32_t p = pairs[data[i] << 8 | data[i + 1]], q = pairs[data[i + 2] << 8 | data[i + 3]];
+            uint32_t c = codes[data[i + 4]];
+            put(p >> 5, p & 31);
+            put(q >> 5, q & 31);
+            put(c >> 4, c & 15);
+            flush();
+        }
+    } else {
+        for (; i + 3 <= size; i += 3) {   // 3 * 15 + 7 bits
+            for (size_t k = i; k < i + 3; ++k) put(codes[data[k]] >> 4, codes[data[k]] & 15);
+            flush();
+        }
+    }
+    for (; i < size; ++i) {
+        put(codes[data[i]] >> 4, codes[data[i]] & 15);
+        flush();
+    }
+    if (count > 0) *op++ = uint8_t(acc << (8 - count));   // last partial byte, zero padded
+    return op;
+}
+
+// BLOCK_HUFFMAN: the bytes themselves with one Huffman table (lengths has
+// a code for every byte in data)
+static void appendHuffman(const uint8_t *data, size_t size, const vector<uint8_t> &lengths, vector<uint8_t> &out) {
+    const size_t headerAt = out.size();
+    appendHeader(out, BLOCK_HUFFMAN, (uint32_t)size, 0);
+    vector<uint8_t> packed = packCodeLengths(lengths);
+    out.insert(out.end(), packed.begin(), packed.end());
+    vector<uint32_t> values = canonicalCodes(lengths);
+    uint32_t codes[256];
+    for (int b = 0; b < 256; ++b) codes[b] = (values[b] << 4) | lengths[b];
+    const unsigned maxLength = *max_element(lengths.begin(), lengths.end());
+
+    const size_t start = out.size();
+    out.resize(start + size * maxLength / 8 + 16);
+    uint8_t *op = encodeHuffmanBytes(data, size, codes, maxLength, out.data() + start);
+    out.resize((size_t)(op - out.data()));
+    storeU32(&out[headerAt + 5], (uint32_t)(out.size() - headerAt - BLOCK_HEADER_SIZE));
+}
+
+// Literal/length and distance code frequencies of a token list
+static void countTokens(const vector<LZ77Token> &tokens, unsigned litLenSymbols, unsigned distSymbols,
+                        vector<uint64_t> &litLenFreq, vector<uint64_t> &distFreq) {
+    litLenFreq.assign(litLenSymbols, 0);
+    distFreq.assign(distSymbols, 0);
+    for (const LZ77Token &t : tokens) {
+        if (t.length == 0) {
+            litLenFreq[t.lit]++;
+        } else {
+            litLenFreq[256 + lz_length_code(t.length)]++;
+            distFreq[lz_dist_code(t.offset)]++;
+        }
+    }
+}
+
+// Joins back-to-back matches at the same distance: long matches arrive in
+// pieces (the matcher's length limit, feedMatch calls)
+static void mergeMatches(vector<LZ77Token> &tokens) {
+    size_t kept = 0;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const LZ77Token &t = tokens[i];
+        if (kept > 0 && t.length > 0) {
+            LZ77Token &last = tokens[kept - 1];
+            if (last.length > 0 && last.offset == t.offset && last.length + t.length <= LZ_LONG_MAX_MATCH) {
+                last.length += t.length;
+                continue;
+            }
+        }
+        tokens[kept++] = t;
+    }
+    tokens.resize(kept);
+}
+static uint64_t codedBits(const vector<uint64_t> &freq, const vector<uint8_t> &lengths) {
+    uint64_t bits = 0;
+    for (size_t s = 0; s < freq.size(); ++s) bits += freq[s] * lengths[s];
+    return bits;
+}
+
+// Fast mode: a run count and a byte histogram decide between RLE,
+// Huffman-only and stored; no LZ77 pass
+static void compressBlockFast(const uint8_t *data, size_t size, vector<uint8_t> &out) {
+    // RLE pays off below one run per 192 bytes (a run costs about 3);
+    // the count stops as soon as that limit is passed
+    const size_t maxRuns = size / 192;
+    size_t runs = 1;
+    for (size_t i = 1; i < size && runs <= maxRuns; ++i) runs += data[i] != data[i - 1];
+    if (runs <= maxRuns) {
+        appendRle(data, size, out);
+        return;
+    }
+
+    uint32_t counts[4][256] = {};   // four tables, so repeated bytes do not serialize the updates
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        counts[0][data[i]]++;
+        counts[1][data[i + 1]]++;
+        counts[2][data[i + 2]]++;
+        counts[3][data[i + 3]]++;
+    }
+    for (; i < size; ++i) counts[0][data[i]]++;
+    vector<uint64_t> freq(256);
+    for (int b = 0; b < 256; ++b) freq[b] = (uint64_t)counts[0][b] + counts[1][b] + counts[2][b] + counts[3][b];
+    vector<uint8_t> lengths = buildCodeLengths(freq, FAST_HUFFMAN_BITS);
+    if (128 + (codedBits(freq, lengths) + 7) / 8 < size - size / 64) appendHuffman(data, size, lengths, out);
+    else appendStored(data, size, out);
+}
+
+// Per token: literal/length code, then for matches the length extra bits,
+// the distance code and the distance extra bits
+static void writeHuffmanTokens(const vector<LZ77Token> &tokens, const vector<uint8_t> &llLen,
+                               const vector<uint32_t> &llVal, const vector<uint8_t> &dLen,
+                               const vector<uint32_t> &dVal, BitWriter &writer) {
+    for (const LZ77Token &t : tokens) {
+        if (t.length == 0) {
+            writer.writeBits(llVal[t.lit], llLen[t.lit]);
+            continue;
+        }
+        unsigned lc = lz_length_code(t.length), dc = lz_dist_code(t.offset);
+        writer.writeBits(llVal[256 + lc], llLen[256 + lc]);
+        writer.writeBits(t.length - lz_length_base(lc), lz_length_extra(lc));
+        writer.writeBits(dVal[dc], dLen[dc]);
+        writer.writeBits(t.offset - lz_dist_base(dc), lz_dist_extra(dc));
+    }
+}
+
+// Same field order with FSE: both initial states, then per token the
+// literal/length state bits, length extra bits, distance state bits and
+// distance extra bits. Encoded back to front, written front to back.
+static void writeFseTokens(const vector<LZ77Token> &tokens, const vector<uint16_t> &litLenNorm,
+                           const vector<uint16_t> &distNorm, BitWriter &writer) {
+    FseEncoder litLen(litLenNorm, FSE_LITLEN_TABLE_LOG), dist(distNorm, FSE_DIST_TABLE_LOG);
+    FseBitStack bits;
+    bits.reserve(tokens.size() * 2 + 2);
+    for (size_t i = tokens.size(); i-- > 0;) {
+        const LZ77Token &t = tokens[i];
+        if (t.length == 0) {
+            litLen.encode(bits, t.lit);
+            continue;
+        }
+        unsigned lc = lz_length_code(t.length), dc = lz_dist_code(t.offset);
+        bits.push(uint32_t(t.offset - lz_dist_base(dc)), lz_dist_extra(dc));
+        dist.encode(bits, dc);
+        bits.push(uint32_t(t.length - lz_length_base(lc)), lz_length_extra(lc));
+        litLen.encode(bits, 256 + lc);
+    }
+    dist.finish(bits);
+    litLen.finish(bits);
+    bits.writeTo(writer);
+}
+
+static void encodeBlock(const uint8_t *data, size_t size, const CompressOptions &options, vector<uint8_t> &out,
+                        const BlockContext *context) {
+    const size_t FEED_CHUNK = 64 * 1024;
+    if (size == 0) { appendStored(data, size, out); return; }
+    if (options.level == COMPRESS_LEVEL_FAST) { compressBlockFast(data, size, out); return; }
+    const Dictionary *dict = options.dictionary.get();
+
+    // Pick the block's mode from its statistics first, so incompressible or
+    // match-free data never pays for an LZ77 pass. Blocks that can draw on a
+    // dictionary or long matches, and tiny ones, always get the LZ77 pass.
+    // Otherwise the exact Huffman-only size is kept to weigh against the
+    // LZ77 result: skewed bytes with few long repeats can code smaller alone.
+    const size_t MEASURE_MIN = 4096;
+    const double MIN_REPEATS = 1.0 / 32;
+    vector<uint8_t> huffmanLengths;
+    uint64_t huffmanBytes = UINT64_MAX;   // BLOCK_HUFFMAN payload, when measured
+    if (size >= MEASURE_MIN && !dict && !(context && !context->matches.empty())) {
+        BlockStats stats = measureBlock(data, size);
+        if (stats.rleSize * 64 <= size) {
+            appendRle(data, size, out);
+            return;
+        }
+        huffmanLengths = buildCodeLengths(stats.freq);
+        huffmanBytes = 128 + (codedBits(stats.freq, huffmanLengths) + 7) / 8;
+        if (stats.repeats < MIN_REPEATS) {
+            if (huffmanBytes < size - size / 64) appendHuffman(data, size, huffmanLengths, out);
+            else appendStored(data, size, out);
+            return;
+        }
+    }
+
+    // LZ77 pass (fresh window per block, so blocks stay independent unless
+    // in long mode); the tokens stay in memory until the code tables are known
+    LZ77StreamCompressor lzstream(65535, 255, options.level);
+    if (dict) lzstream.prime(dict->content.data(), dict->content.size());
+    else if (context && context->history > 0) {
+        size_t primed = min<size_t>(context->history, 65535);
+        lzstream.prime(data - primed, primed);
+    }
+    vector<LZ77Token> tokens;
+    tokens.reserve(size / 2);
+    size_t at = 0;
+    auto feedUpTo = [&](size_t end, bool isLast) {
+        do {
+            size_t len = min(FEED_CHUNK, end - at);
+            lzstream.feed(data + at, len, isLast && at + len == end);
+            at += len;
+            auto chunk = lzstream.consumeTokens();
+            tokens.insert(tokens.end(), chunk.begin(), chunk.end());
+        } while (at < end);
+    };
+    if (context) {
+        // long matches beyond the regular window go in as found; the
+        // regular matcher parses the gaps (and finds the nearer repeats)
+        for (const LongMatch &m : context->matches) {
+            if (m.dist <= 65535) continue;
+            if (m.pos > at) feedUpTo((size_t)m.pos, false);
+            for (size_t left = (size_t)m.length; left > 0;) {
+                size_t len = min(left, LZ_LONG_MAX_MATCH);
+                lzstream.feedMatch(data + at, len, (size_t)m.dist);
+                at += len;
+                left -= len;
+            }
+        }
+    }
+    feedUpTo(size, true);
+
+    // Long blocks only when some match needs the long alphabets or reaches
+    // before the block; otherwise the block is an ordinary split block
+    bool longMode = false;
+    if (context) {
+        mergeMatches(tokens);
+        size_t pos = 0;
+        for (const LZ77Token &t : tokens) {
+            if (t.length == 0) { ++pos; continue; }
+            if (t.length > 258 || t.offset > pos) { longMode = true; break; }
+            pos += t.length;
+        }
+    }
+
+    // Per-block canonical Huffman tables, unless the dictionary's tables
+    // code these tokens in fewer bits than the block's own tables cost, or
+    // FSE tables do (dictionary blocks stay with Huffman)
+    vector<uint64_t> litLenFreq, distFreq;
+    countTokens(tokens, longMode ? LZ_LONG_LITLEN_SYMBOLS : LZ_LITLEN_SYMBOLS,
+                longMode ? LZ_LONG_DIST_SYMBOLS : LZ_DIST_SYMBOLS, litLenFreq, distFreq);
+    vector<uint8_t> litLenLengths = buildCodeLengths(litLenFreq);
+    vector<uint8_t> distLengths = buildCodeLengths(distFreq);
+    vector<uint8_t> packedLitLen = packCodeLengths(litLenLengths);
+    vector<uint8_t> packedDist = packCodeLengths(distLengths);
+    const uint64_t ownBits = (packedLitLen.size() + packedDist.size()) * 8 +
+                             codedBits(litLenFreq, litLenLengths) + codedBits(distFreq, distLengths);
+    bool shared = false;
+    if (dict) {
+        uint64_t dictBits = codedBits(litLenFreq, dict->litLen.lengths) + codedBits(distFreq, dict->dist.lengths);
+        shared = dictBits <= ownBits;
+    }
+    vector<uint16_t> litLenNorm, distNorm;
+    bool fse = false;
+    if (!dict) {
+        if (distFreq[0] == 0 && all_of(distFreq.begin(), distFreq.end(), [](uint64_t f) { return f == 0; }))
+            distFreq[0] = 1;   // no matches: any valid table will do
+        litLenNorm = fseNormalize(litLenFreq, FSE_LITLEN_TABLE_LOG);
+        distNorm = fseNormalize(distFreq, FSE_DIST_TABLE_LOG);
+        BitCounter tables;
+        fseWriteCounts(tables, litLenNorm, FSE_LITLEN_TABLE_LOG);
+        fseWriteCounts(tables, distNorm, FSE_DIST_TABLE_LOG);
+        uint64_t fseBits = tables.bits + FSE_LITLEN_TABLE_LOG + FSE_DIST_TABLE_LOG +
+                           fseCost(litLenFreq, litLenNorm, FSE_LITLEN_TABLE_LOG) +
+                           fseCost(distFreq, distNorm, FSE_DIST_TABLE_LOG);
+        fse = fseBits < ownBits;
+    }
+
+    // Emit straight after a provisional header, then patch in the payload
+    // size; roll back to a stored block if coding did not pay off
+    const size_t headerAt = out.size();
+    if (fse) {
+        appendHeader(out, longMode ? BLOCK_FSE_LONG : BLOCK_FSE_SPLIT, (uint32_t)size, 0);
+        appendU32(out, (uint32_t)tokens.size());
+        BitWriter writer(out);
+        fseWriteCounts(writer, litLenNorm, FSE_LITLEN_TABLE_LOG);
+        fseWriteCounts(writer, distNorm, FSE_DIST_TABLE_LOG);
+        writeFseTokens(tokens, litLenNorm, distNorm, writer);
+        writer.flush();
+    } else {
+        appendHeader(out, longMode ? BLOCK_LZ_LONG : !dict ? BLOCK_LZ_SPLIT : shared ? BLOCK_DICT_LZ_SHARED : BLOCK_DICT_LZ_SPLIT,
+                     (uint32_t)size, 0);
+        if (dict) appendU32(out, dict->id);
+        if (!shared) {
+            out.insert(out.end(), packedLitLen.begin(), packedLitLen.end());
+            out.insert(out.end(), packedDist.begin(), packedDist.end());
+        }
+        appendU32(out, (uint32_t)tokens.size());
+        BitWriter writer(out);
+        if (shared) {
+            writeHuffmanTokens(tokens, dict->litLen.lengths, dict->litLen.values, dict->dist.lengths, dict->dist.values, writer);
+        } else {
+            writeHuffmanTokens(tokens, litLenLengths, canonicalCodes(litLenLengths), distLengths, canonicalCodes(distLengths),
+                               writer);
+        }
+        writer.flush();
+    }
+
+    size_t payloadSize = out.size() - headerAt - BLOCK_HEADER_SIZE;
+    if (huffmanBytes <= payloadSize && huffmanBytes < size) {
+        out.resize(headerAt);
+        appendHuffman(data, size, huffmanLengths, out);
+        return;
+    }
+    if (payloadSize >= size) {
+        out.resize(headerAt);
+        appendStored(data, size, out);
+        return;
+    }
+    storeU32(&out[headerAt + 5], (uint32_t)payloadSize);
+}
+
+void compressBlock(const uint8_t *data, size_t size, const CompressOptions &options, vector<uint8_t> &out,
+                   const BlockContext *context) {
+    const size_t headerAt = out.size();
+    encodeBlock(data, size, options, out, context);
+    if (options.level != LZ77_LEVEL_ULTRA) return;
+
+    // Ultra's optimal parse follows estimated prices, which some data (long
+    // zero runs between random bytes) leads astray. Blocks that went through
+    // LZ77 are also parsed at level 9, and the smaller result is kept.
+    uint8_t mode = out[headerAt];
+    if (mode == BLOCK_STORED || mode == BLOCK_HUFFMAN || mode == BLOCK_RLE) return;
+    CompressOptions nine = options;
+    nine.level = LZ77_MAX_LEVEL;
+    vector<uint8_t> alternative;
+    encodeBlock(data, size, nine, alternative, context);
+    if (alternative.size() < out.size() - headerAt) {
+        out.resize(headerAt);
+        out.insert(out.end(), alternative.begin(), alternative.end());
+    }
+}
+
+BlockHeader parseBlockHeader(const uint8_t *raw) {
+    BlockHeader header;
+    header.mode = raw[0];
+    header.rawSize = loadU32(raw + 1);
+    header.payloadSize = loadU32(raw + 5);
+    return header;
+}
+
+bool readBlockHeader(istream &in, BlockHeader &header) {
+    uint8_t raw[BLOCK_HEADER_SIZE];
+    in.read(reinterpret_cast<char*>(raw), BLOCK_HEADER_SIZE);
+    if (in.gcount() == 0) return false;
+    if ((size_t)in.gcount() != BLOCK_HEADER_SIZE) throw runtime_error("Truncated block header.");
+    header = parseBlockHeader(raw);
+    return true;
+}
+
+// BLOCK_HUFFMAN with codes of at most FAST_HUFFMAN_BITS (fast mode): one
+// flat table, entries byte | length << 8, and a refill per five bytes
+static void decodeHuffmanBytes(const vector<uint8_t> &lengths, BitReader &reader, uint8_t *dst, size_t size) {
+    const unsigned BITS = FAST_HUFFMAN_BITS;
+    vector<uint16_t> table(size_t(1) << BITS, 0);   // length 0: no such code
+    vector<uint32_t> values = canonicalCodes(lengths);
+    for (int b = 0; b < 256; ++b) {
+        if (lengths[b] == 0) continue;
+        const uint32_t first = values[b] << (BITS - lengths[b]), span = 1u << (BITS - lengths[b]);
+        // canonical codes only leave the table when the lengths oversubscribe it
+        if (first + span > table.size()) throw runtime_error("Corrupted block payload (bad code lengths).");
+        for (uint32_t k = 0; k < span; ++k) table[first + k] = uint16_t(b | lengths[b] << 8);
+    }
+    auto next = [&](uint8_t &byte) {
+        uint16_t e = table[reader.peekBits(BITS)];
+        if ((e >> 8) == 0) throw runtime_error("Invalid Huffman code in bitstream.");
+        reader.skipBits(e >> 8);
+        byte = (uint8_t)e;
+    };
+    size_t i = 0;
+    for (; i + 5 <= size; i += 5) {   // 5 * 11 bits within the 57 a refill guarantees
+        reader.refill();
+        for (size_t k = i; k < i + 5; ++k) next(dst[k]);
+    }
+    for (; i < size; ++i) {
+        reader.refill();
+        next(dst[i]);
+    }
+}
+
+// Extra bits right after a decoded symbol: decode() leaves at least
+// 57 - HUFFMAN_MAX_BITS bits buffered, more than any extra field
+static inline size_t readExtra(BitReader &reader, unsigned n) {
+    if (n == 0) return 0;
+    size_t v = reader.peekBits(n);
+    reader.skipBits(n);
+    return v;
+}
+
+// Fused decode of split-alphabet tokens into dst. history bytes before dst
+// (a primed dictionary) may be referenced; dst has LZ77_COPY_SLACK spare.
+static void decodeSplitTokens(const HuffmanDecoder &litLen, const HuffmanDecoder &dist, BitReader &reader,
+                              unsigned lengthCodes, unsigned distSymbols,
+                              uint32_t tokenCount, uint8_t *dst, size_t rawSize, size_t history) {
+    uint8_t *const dstEnd = dst + rawSize;
+    uint8_t *op = dst;
+
+    for (uint32_t i = 0; i < tokenCount; ++i) {
+        uint32_t sym = litLen.decode(reader);
+        if (sym < 256) {
+            if (op == dstEnd) throw runtime_error("Corrupted block payload (size mismatch).");
+            *op++ = (uint8_t)sym;
+            continue;
+        }
+        unsigned lc = sym - 256;
+        if (lc >= lengthCodes) throw runtime_error("Corrupted block payload (bad token).");
+        size_t length = lz_length_base(lc) + readExtra(reader, lz_length_extra(lc));
+        unsigned dc = dist.decode(reader);
+        if (dc >= distSymbols) throw runtime_error("Corrupted block payload (bad token).");
+        size_t offset = lz_dist_base(dc) + readExtra(reader, lz_dist_extra(dc));
+        if (offset > (size_t)(op - dst) + history) throw runtime_error("Corrupted block payload (bad match offset).");
+        if (length > (size_t)(dstEnd - op)) throw runtime_error("Corrupted block payload (size mismatch).");
+        lz77_copy_match(op, offset, length);
+        op += length;
+    }
+    if (reader.overrun()) throw runtime_error("Corrupted block payload (bitstream overrun).");
+    if (op != dstEnd) throw runtime_error("Corrupted block payload (size mismatch).");
+}
+
+// Fused decode of FSE-coded split-alphabet tokens; same contract as
+// decodeSplitTokens. After a refill the reader holds 57 bits: enough for
+// state bits plus extra bits of one field pair.
+static void decodeFseTokens(const FseDecoder &litLen, const FseDecoder &dist, BitReader &reader,
+                            uint32_t tokenCount, uint8_t *dst, size_t rawSize, size_t history) {
+    uint8_t *const dstEnd = dst + rawSize;
+    uint8_t *op = dst;
+
+    reader.refill();
+    uint32_t litLenState = readExtra(reader, litLen.log());
+    uint32_t distState = readExtra(reader, dist.log());
+    for (uint32_t i = 0; i < tokenCount; ++i) {
+        reader.refill();
+        const FseDecoder::Entry &e = litLen[litLenState];
+        litLenState = e.base + (uint32_t)readExtra(reader, e.bits);
+        if (e.symbol < 256) {
+            if (op == dstEnd) throw runtime_error("Corrupted block payload (size mismatch).");
+            *op++ = (uint8_t)e.symbol;
+            continue;
+        }
+        unsigned lc = e.symbol - 256;   // in range: the table only holds alphabet symbols
+        size_t length = lz_length_base(lc) + readExtra(reader, lz_length_extra(lc));
+        reader.refill();
+        const FseDecoder::Entry &d = dist[distState];
+        distState = d.base + (uint32_t)readExtra(reader, d.bits);
+        size_t offset = lz_dist_base(d.symbol) + readExtra(reader, lz_dist_extra(d.symbol));
+        if (offset > (size_t)(op - dst) + history) throw runtime_error("Corrupted block payload (bad match offset).");
+        if (length > (size_t)(dstEnd - op)) throw runtime_error("Corrupted block payload (size mismatch).");
+        lz77_copy_match(op, offset, length);
+        op += length;
+    }
+    if (reader.overrun()) throw runtime_error("Corrupted block payload (bitstream overrun).");
+    if (op != dstEnd) throw runtime_error("Corrupted block payload (size mismatch).");
+}
+
+void decompressBlock(const BlockHeader &header, const uint8_t *payload, vector<uint8_t> &out, const Dictionary *dict,
+                     size_t history) {
+    if (header.mode == BLOCK_STORED) {
+        if (header.payloadSize != header.rawSize) throw runtime_error("Corrupted stored block.");
+        out.insert(out.end(), payload, payload + header.rawSize);
+        return;
+    }
+    if (header.mode == BLOCK_HUFFMAN) {
+        if (header.payloadSize < 128) throw runtime_error("Corrupted block payload.");
+        vector<uint8_t> lengths = unpackCodeLengths(payload, 256);
+        BitReader reader(payload + 128, header.payloadSize - 128);
+        const size_t base = out.size();
+        out.resize(base + header.rawSize);
+        uint8_t *op = out.data() + base;
+        if (*max_element(lengths.begin(), lengths.end()) <= FAST_HUFFMAN_BITS) {
+            decodeHuffmanBytes(lengths, reader, op, header.rawSize);
+        } else {
+            HuffmanDecoder decoder;
+            decoder.buildFromLengths(lengths);
+            for (uint32_t i = 0; i < header.rawSize; ++i) op[i] = (uint8_t)decoder.decode(reader);
+        }
+        if (reader.overrun()) throw runtime_error("Corrupted block payload (bitstream overrun).");
+        return;
+    }
+    if (header.mode == BLOCK_RLE) {
+        const uint8_t *p = payload, *end = payload + header.payloadSize;
+        const size_t base = out.size();
+        out.resize(base + header.rawSize);
+        uint8_t *op = out.data() + base, *opEnd = op + header.rawSize;
+        while (op < opEnd) {
+            if (end - p < 2) throw runtime_error("Corrupted block payload.");
+            uint8_t value = *p++;
+            uint64_t run = 0;
+            for (unsigned shift = 0;; shift += 7) {
+                if (p == end || shift > 28) throw runtime_error("Corrupted block payload.");
+                uint8_t b = *p++;
+                run |= uint64_t(b & 0x7F) << shift;
+                if (!(b & 0x80)) break;
+            }
+            if (run >= (uint64_t)(opEnd - op)) throw runtime_error("Corrupted block payload (size mismatch).");
+            memset(op, value, (size_t)run + 1);
+            op += run + 1;
+        }
+        if (p != end) throw runtime_error("Corrupted block payload (size mismatch).");
+        return;
+    }
+    if (header.mode == BLOCK_FSE_SPLIT || header.mode == BLOCK_FSE_LONG) {
+        const bool longMode = header.mode == BLOCK_FSE_LONG;
+        if (header.payloadSize < 4) throw runtime_error("Corrupted block payload.");
+        uint32_t tokenCount = loadU32(payload);
+        BitReader reader(payload + 4, header.payloadSize - 4);
+        FseDecoder litLen, dist;
+        litLen.build(fseReadCounts(reader, longMode ? LZ_LONG_LITLEN_SYMBOLS : LZ_LITLEN_SYMBOLS, FSE_LITLEN_TABLE_LOG),
+                     FSE_LITLEN_TABLE_LOG);
+        dist.build(fseReadCounts(reader, longMode ? LZ_LONG_DIST_SYMBOLS : LZ_DIST_SYMBOLS, FSE_DIST_TABLE_LOG),
+                   FSE_DIST_TABLE_LOG);
+
+        const size_t base = out.size();
+        out.resize(base + header.rawSize + LZ77_COPY_SLACK);
+        decodeFseTokens(litLen, dist, reader, tokenCount, out.data() + base, header.rawSize,
+                        longMode ? min(history, base) : 0);
+        out.resize(base + header.rawSize);
+        return;
+    }
+    if (header.mode != BLOCK_LZ_SPLIT && header.mode != BLOCK_DICT_LZ_SPLIT && header.mode != BLOCK_DICT_LZ_SHARED &&
+        header.mode != BLOCK_LZ_LONG)
+        throw runtime_error("Unknown block mode.");
+    const bool longMode = header.mode == BLOCK_LZ_LONG;
+    const unsigned litLenSymbols = longMode ? LZ_LONG_LITLEN_SYMBOLS : LZ_LITLEN_SYMBOLS;
+    const unsigned distSymbols = longMode ? LZ_LONG_DIST_SYMBOLS : LZ_DIST_SYMBOLS;
+    const size_t LITLEN_TABLE = (litLenSymbols + 1) / 2, DIST_TABLE = (distSymbols + 1) / 2;
+
+    // optional dictionary id, then the tables unless the dictionary's are used
+    const uint8_t *p = payload, *end = payload + header.payloadSize;
+    const bool primed = header.mode == BLOCK_DICT_LZ_SPLIT || header.mode == BLOCK_DICT_LZ_SHARED;
+    if (primed) {
+        if (end - p < 4) throw runtime_error("Corrupted block payload.");
+        uint32_t id = loadU32(p);
+        p += 4;
+        if (!dict || dict->id != id) {
+            ostringstream msg;
+            msg << "Block was compressed with dictionary " << hex << setw(8) << setfill('0') << id << "; pass it with --dict.";
+            throw runtime_error(msg.str());
+        }
+    }
+    HuffmanDecoder ownLitLen, ownDist;
+    const HuffmanDecoder *litLen = &ownLitLen, *dist = &ownDist;
+    if (header.mode == BLOCK_DICT_LZ_SHARED) {
+        litLen = &dict->litLen.decoder;
+        dist = &dict->dist.decoder;
+    } else {
+        if ((size_t)(end - p) < LITLEN_TABLE + DIST_TABLE) throw runtime_error("Corrupted block payload.");
+        ownLitLen.buildFromLengths(unpackCodeLengths(p, litLenSymbols));
+        ownDist.buildFromLengths(unpackCodeLengths(p + LITLEN_TABLE, distSymbols));
+        p += LITLEN_TABLE + DIST_TABLE;
+    }
+    if (end - p < 4) throw runtime_error("Corrupted block payload.");
+    uint32_t tokenCount = loadU32(p);
+    p += 4;
+    BitReader reader(p, (size_t)(end - p));
+
+    if (!primed) {
+        // in place, behind whatever of out a long block may reference
+        const size_t base = out.size();
+        out.resize(base + header.rawSize + LZ77_COPY_SLACK);
+        decodeSplitTokens(*litLen, *dist, reader, litLenSymbols - 256, distSymbols, tokenCount,
+                          out.data() + base, header.rawSize, longMode ? min(history, base) : 0);
+        out.resize(base + header.rawSize);
+        return;
+    }
+    // Decode behind a copy of the dictionary, so matches can reach into it
+    const size_t primedSize = dict->content.size();
+    vector<uint8_t> window(primedSize + header.rawSize + LZ77_COPY_SLACK);
+    memcpy(window.data(), dict->content.data(), primedSize);
+    decodeSplitTokens(*litLen, *dist, reader, LZ_LENGTH_CODES, LZ_DIST_SYMBOLS, tokenCount,
+                      window.data() + primedSize, header.rawSize, primedSize);
+    out.insert(out.end(), window.begin() + primedSize, window.begin() + primedSize + header.rawSize);
+}
+
+static vector<uint8_t> blockStreamHeader(uint64_t size, const string &ext, const CompressOptions &options,
+                                         unsigned windowLog = 0) {
+    const Dictionary *dict = options.dictionary.get();
+    uint8_t flags = (dict ? KP06_FLAG_DICTIONARY : 0) | (windowLog ? KP06_FLAG_LONG_WINDOW : 0);
+    vector<uint8_t> header = streamPrologue(KITTY_MAGIC_V6, flags, ext);
+    appendU64(header, size);
+    appendU32(header, (uint32_t)options.blockSize);
+    if (dict) appendU32(header, dict->id);
+    if (windowLog) header.push_back((uint8_t)windowLog);
+    return header;
+}
+
+// Shared by both queueBlockStream variants: the KP06 header, one ordered
+// pool job per block, and an empty end marker that reports the stream size
+static shared_ptr<uint64_t> queueBlockHeader(OrderedWriter &writer, uint64_t size, const string &ext,
+                                             const CompressOptions &options, unsigned windowLog = 0) {
+    auto start = make_shared<uint64_t>(0);
+    writer.push(blockStreamHeader(size, ext, options, windowLog),
+                [start](uint64_t at, const vector<uint8_t> &) { *start = at; });
+    return start;
+}
+
+template <class Job>
+static void queueBlockJob(OrderedWriter &writer, ThreadPool &pool, Job &&job) {
+    shared_future<vector<uint8_t>> encoded = pool.submit(forward<Job>(job)).share();
+    writer.push([encoded]() { return encoded.get(); });
+}
+
+static void queueBlockEnd(OrderedWriter &writer, const shared_ptr<uint64_t> &start, function<void(uint64_t)> onDone) {
+    writer.push(vector<uint8_t>(), [start, onDone](uint64_t at, const vector<uint8_t> &) {
+        if (onDone) onDone(at - *start);
+    });
+}
+
+// Long mode on a stream: the finder needs the window before each block in
+// memory, so the input goes through a buffer holding at least the last
+// 1 << windowLog bytes. Each job gets a copy of its block and of the 64 KiB
+// before it, all compressBlock reads.
+static uint32_t queueLongBlockStream(OrderedWriter &writer, ThreadPool &pool, istream &in, uint64_t size,
+                                     const string &ext, const CompressOptions &options,
+                                     function<void(uint64_t)> onDone) {
+    const uint64_t window = uint64_t(1) << options.longWindowLog;
+    const size_t HISTORY = 65535;
+    LongMatchFinder finder(nullptr, size, options.longWindowLog);
+    auto start = queueBlockHeader(writer, size, ext, options, options.longWindowLog);
+    vector<uint8_t> buffer;   // input bytes [bufferBase, off)
+    uint64_t bufferBase = 0;
+    uint32_t crc = 0;
+    for (uint64_t off = 0; off < size; off += options.blockSize) {
+        size_t len = (size_t)min<uint64_t>(options.blockSize, size - off);
+        // drop what the window no longer reaches once that is as much as
+        // the window itself, so each byte is moved about once
+        if (off - bufferBase >= 2 * window) {
+            size_t drop = (size_t)(off - window - bufferBase);
+            buffer.erase(buffer.begin(), buffer.begin() + drop);
+            bufferBase += drop;
+        }
+        const size_t at = buffer.size();
+        buffer.resize(at + len);
+        in.read(reinterpret_cast<char*>(buffer.data() + at), (streamsize)len);
+        if ((size_t)in.gcount() != len) throw runtime_error("Input changed size while compressing.");
+        crc = crc32Update(crc, buffer.data() + at, len);
+
+        auto context = make_shared<BlockContext>();
+        finder.setView(buffer.data(), bufferBase, off + len);
+        context->matches = finder.findMatches(off, off + len);
+        for (LongMatch &m : context->matches) m.pos -= off;
+        context->history = (size_t)min<uint64_t>(off, HISTORY);
+        vector<uint8_t> data(buffer.begin() + (at - context->history), buffer.end());
+        queueBlockJob(writer, pool, [data = move(data), len, options, context]() {
+            vector<uint8_t> encoded;
+            compressBlock(data.data() + context->history, len, options, encoded, context.get());
+            return encoded;
+        });
+    }
+    queueBlockEnd(writer, start, onDone);
+    return crc;
+}
+
+uint32_t queueBlockStream(OrderedWriter &writer, ThreadPool &pool, istream &in, uint64_t size,
+                          const string &ext, const CompressOptions &options,
+                          function<void(uint64_t)> onDone) {
+    if (options.longWindowLog > 0 && !options.dictionary)
+        return queueLongBlockStream(writer, pool, in, size, ext, options, onDone);
+    auto start = queueBlockHeader(writer, size, ext, options);
+    uint32_t crc = 0;
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        vector<uint8_t> block((size_t)min<uint64_t>(options.blockSize, remaining));
+        in.read(reinterpret_cast<char*>(block.data()), (streamsize)block.size());
+        if ((size_t)in.gcount() != block.size()) throw runtime_error("Input changed size while compressing.");
+        remaining -= block.size();
+        crc = crc32Update(crc, block.data(), block.size());
+
+        queueBlockJob(writer, pool, [data = move(block), options]() {
+            vector<uint8_t> encoded;
+            compressBlock(data.data(), data.size(), options, encoded);
+            return encoded;
+        });
+    }
+    queueBlockEnd(writer, start, onDone);
+    return crc;
+}
+
+uint32_t queueBlockStream(OrderedWriter &writer, ThreadPool &pool, shared_ptr<const void> owner,
+                          const uint8_t *data, uint64_t size, const string &ext,
+                          const CompressOptions &options, function<void(uint64_t)> onDone) {
+    // Long mode: one finder walks the blocks in order, so each job gets the
+    // long matches of its block up front and the pool still runs in parallel
+    const bool longMode = options.longWindowLog > 0 && !options.dictionary;
+    unique_ptr<LongMatchFinder> finder;
+    if (longMode) finder.reset(new LongMatchFinder(data, size, options.longWindowLog));
+    auto start = queueBlockHeader(writer, size, ext, options, longMode ? options.longWindowLog : 0);
+    uint32_t crc = 0;
+    for (uint64_t off = 0; off < size; off += options.blockSize) {
+        const uint8_t *block = data + off;
+        size_t len = (size_t)min<uint64_t>(options.blockSize, size - off);
+        crc = crc32Update(crc, block, len);
+        if (longMode) {
+            auto context = make_shared<BlockContext>();
+            context->history = (size_t)min<uint64_t>(off, uint64_t(1) << options.longWindowLog);
+            context->matches = finder->findMatches(off, off + len);
+            for (LongMatch &m : context->matches) m.pos -= off;
+            queueBlockJob(writer, pool, [owner, block, len, options, context]() {
+                vector<uint8_t> encoded;
+                compressBlock(block, len, options, encoded, context.get());
+                return encoded;
+            });
+            continue;
+        }
+        // workers read straight from the caller's memory; owner keeps it alive
+        queueBlockJob(writer, pool, [owner, block, len, options]() {
+            vector<uint8_t> encoded;
+            compressBlock(block, len, options, encoded);
+            return encoded;
+        });
+    }
+    queueBlockEnd(writer, start, onDone);
+    return crc;
+}
+
+vector<uint8_t> encodeBlockStream(const uint8_t *data, size_t size, const string &ext, const CompressOptions &options) {
+    vector<uint8_t> out = blockStreamHeader(size, ext, options);
+    for (size_t off = 0; off < size; off += options.blockSize)
+        compressBlock(data + off, min(options.blockSize, size - off), options, out);
+    return out;
+}
+
+vector<uint8_t> encodeRawStream(const uint8_t *data, size_t size, const string &ext) {
+    vector<uint8_t> out = streamPrologue(KITTY_MAGIC_V5, 0, ext);
+    appendU64(out, size);
+    out.insert(out.end(), data, data + size);
+    return out;
+}
+
+uint32_t queueRawStream(OrderedWriter &writer, istream &in, uint64_t size,
+                        const string &ext, function<void(uint64_t)> onDone) {
+    const size_t COPY_CHUNK = 1 << 20;
+    auto start = make_shared<uint64_t>(0);
+
+    vector<uint8_t> header = streamPrologue(KITTY_MAGIC_V5, 0, ext);
+    appendU64(header, size);
+    writer.push(move(header), [start](uint64_t at, const vector<uint8_t> &) { *start = at; });
+
+    uint32_t crc = 0;
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        vector<uint8_t> chunk((size_t)min<uint64_t>(COPY_CHUNK, remaining));
+        in.read(reinterpret_cast<char*>(chunk.data()), (streamsize)chunk.size());
+        if ((size_t)in.gcount() != chunk.size()) throw runtime_error("Input changed size while storing.");
+        remaining -= chunk.size();
+        crc = crc32Update(crc, chunk.data(), chunk.size());
+        writer.push(move(chunk));
+    }
+    writer.push(vector<uint8_t>(), [start, onDone](uint64_t at, const vector<uint8_t> &) {
+        if (onDone) onDone(at - *start);
+    });
+    return crc;
+}
+
+uint32_t queueRawStream(OrderedWriter &writer, shared_ptr<const void> owner, const uint8_t *data,
+                        uint64_t size, const string &ext, function<void(uint64_t)> onDone) {
+    const size_t COPY_CHUNK = 1 << 20;
+    auto start = make_shared<uint64_t>(0);
+
+    vector<uint8_t> header = streamPrologue(KITTY_MAGIC_V5, 0, ext);
+    appendU64(header, size);
+    writer.push(move(header), [start](uint64_t at, const vector<uint8_t> &) { *start = at; });
+
+    // chunks are copied out of memory only when their turn to be written comes
+    uint32_t crc = 0;
+    for (uint64_t off = 0; off < size; off += COPY_CHUNK) {
+        const uint8_t *chunk = data + off;
+        size_t len = (size_t)min<uint64_t>(COPY_CHUNK, size - off);
+        crc = crc32Update(crc, chunk, len);
+        writer.push([owner, chunk, len]() { return vector<uint8_t>(chunk, chunk + len); });
+    }
+    writer.push(vector<uint8_t>(), [start, onDone](uint64_t at, const vector<uint8_t> &) {
+        if (onDone) onDone(at - *start);
+    });
+    return crc;
+}
@@ -0,0 +1,117 @@
+// block.h
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "huffman.h"
+#include "threadpool.h"
+
+// KP06 splits a file into independent blocks, each with its own Huffman
+// table, so blocks can be compressed and decompressed in parallel.
+// Every block starts with a 9-byte header: mode, raw size, payload size.
+enum BlockMode : uint8_t {
+    BLOCK_STORED = 0,  // payload is the raw bytes
+    // Window primed with a trained dictionary; the payload starts with its uint32 id
+    BLOCK_DICT_LZ_SPLIT  = 2,  // then as BLOCK_LZ_SPLIT
+    BLOCK_DICT_LZ_SHARED = 3,  // then uint32 token count, tokens coded with the dictionary's tables
+    // 142 + 16 bytes of literal/length and distance code lengths, uint32 token
+    // count, then per token a literal/length code, and for matches its extra
+    // bits, a distance code and its extra bits (see lz_length_code/lz_dist_code)
+    BLOCK_LZ_SPLIT = 4,
+    // As BLOCK_LZ_SPLIT with the long alphabets (172 + 27 bytes of code
+    // lengths); matches may reach back into earlier blocks of the stream
+    BLOCK_LZ_LONG = 5,
+    // As BLOCK_LZ_SPLIT / BLOCK_LZ_LONG with FSE instead of Huffman: uint32
+    // token count, then a bitstream of both FSE table descriptions, both
+    // initial states and per token the literal/length state bits, length
+    // extra bits, distance state bits and distance extra bits (see fse.h)
+    BLOCK_FSE_SPLIT = 6,
+    BLOCK_FSE_LONG  = 7,
+    // No LZ77 pass (chosen from the block's statistics)
+    BLOCK_HUFFMAN = 8,  // 128 bytes of code lengths, then every byte Huffman coded
+    BLOCK_RLE     = 9,  // {byte, varint run length - 1} pairs (LEB128 varints)
+};
+
+// FSE table sizes of the token alphabets
+const unsigned FSE_LITLEN_TABLE_LOG = 11;
+const unsigned FSE_DIST_TABLE_LOG = 8;
+
+struct BlockHeader {
+    uint8_t mode;
+    uint32_t rawSize;
+    uint32_t payloadSize;
+};
+
+const size_t BLOCK_HEADER_SIZE = 9;
+
+// KP06 header flag: blocks use a trained dictionary, whose uint32 id follows
+// the block size field
+const uint8_t KP06_FLAG_DICTIONARY = 0x02;
+// KP06 header flag: long mode, whose blocks depend on the ones before them
+// and decode serially. A uint8 window log follows the block size (and
+// dictionary id) fields; matches reach at most 1 << log bytes back.
+const uint8_t KP06_FLAG_LONG_WINDOW = 0x04;
+
+// Location of one block (the chunk store's block table)
+struct BlockIndexEntry {
+    uint64_t offset;          // of the block header
+    uint32_t compressedSize;  // header + payload
+    uint32_t rawSize;
+};
+
+// What a long-mode block may see of the stream before it
+struct BlockContext {
+    size_t history = 0;               // readable bytes before data
+    std::vector<LongMatch> matches;   // from a LongMatchFinder, pos relative to data, in order
+};
+
+// Compresses one block and appends header + payload to out: stored,
+// Huffman-only, RLE or LZ77 tokens, whichever its statistics favour (and
+// stored whenever coding does not pay off). options.dictionary, when set,
+// primes the window; context, when set, allows long-mode blocks.
+void compressBlock(const uint8_t *data, size_t size, const CompressOptions &options, std::vector<uint8_t> &out,
+                   const BlockContext *context = nullptr);
+
+// Parses the BLOCK_HEADER_SIZE bytes at raw
+BlockHeader parseBlockHeader(const uint8_t *raw);
+
+// Reads a block header; returns false at a clean end of stream
+bool readBlockHeader(std::istream &in, BlockHeader &header);
+
+// Decodes one block payload and appends header.rawSize bytes to out;
+// dictionary blocks need the matching dict. BLOCK_LZ_LONG matches may
+// reference the last history bytes already in out.
+void decompressBlock(const BlockHeader &header, const uint8_t *payload, std::vector<uint8_t> &out,
+                     const Dictionary *dict = nullptr, size_t history = 0);
+
+// Stream producers shared by compressFile and createArchive. Each queues one
+// complete .kitty stream for size bytes read from in; onDone(streamSize) runs
+// on the writer thread once the stream's last byte is committed. They return
+// the CRC-32 of the input bytes.
+
+// KP06: header, then the blocks compressed on pool
+uint32_t queueBlockStream(OrderedWriter &writer, ThreadPool &pool, std::istream &in, uint64_t size,
+                          const std::string &ext, const CompressOptions &options,
+                          std::function<void(uint64_t)> onDone = nullptr);
+
+// Same, reading blocks straight from memory (e.g. a MappedFile) that owner
+// keeps alive. Both variants do long mode (options.longWindowLog); the
+// stream one keeps the window buffered.
+uint32_t queueBlockStream(OrderedWriter &writer, ThreadPool &pool, std::shared_ptr<const void> owner,
+                          const uint8_t *data, uint64_t size, const std::string &ext,
+                          const CompressOptions &options, std::function<void(uint64_t)> onDone = nullptr);
+
+// Complete streams built in memory, for inputs small enough to encode
+// both ways and keep the shorter: KP06 and KP05 raw
+std::vector<uint8_t> encodeBlockStream(const uint8_t *data, size_t size, const std::string &ext,
+                                       const CompressOptions &options);
+std::vector<uint8_t> encodeRawStream(const uint8_t *data, size_t size, const std::string &ext);
+
+// KP05 with isCompressed = false
+uint32_t queueRawStream(OrderedWriter &writer, std::istream &in, uint64_t size,
+                        const std::string &ext, std::function<void(uint64_t)> onDone = nullptr);
+uint32_t queueRawStream(OrderedWriter &writer, std::shared_ptr<const void> owner, const uint8_t *data,
+                        uint64_t size, const std::string &ext, std::function<void(uint64_t)> onDone = nullptr);
@@ -3,7 +3,7 @@ echo Building KittyPress v4 ...
 echo.
 
 :: Compile all sources with static linking
-g++ main.cpp archive.cpp huffman.cpp lz77.cpp bitstream.cpp ^
+g++ main.cpp archive.cpp huffman.cpp lz77.cpp bitstream.cpp block.cpp threadpool.cpp fileio.cpp checksum.cpp dedup.cpp dictionary.cpp fse.cpp ^
     -std=c++17 -O2 -static -static-libstdc++ -static-libgcc -o kittypress.exe
 
 IF %ERRORLEVEL% NEQ 0 (
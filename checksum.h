@@ -0,0 +1,35 @@
+// checksum.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// CRC-32 (IEEE 802.3, as in zip/gzip). Start from 0 and feed data in any
+// number of pieces: crc = crc32Update(crc, data, size).
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t size);
+
+// CRC-32 of a whole file (mapped when possible, otherwise streamed)
+uint32_t fileCrc32(const std::string &path);
+
+// 128-bit content hash (MurmurHash3 x64-128). Fast, but not collision
+// resistant: fine for ids, not for deciding two inputs are equal.
+struct Hash128 {
+    uint64_t lo, hi;
+    bool operator==(const Hash128 &o) const { return lo == o.lo && hi == o.hi; }
+};
+
+Hash128 hash128(const uint8_t *data, size_t size, uint64_t seed = 0);
+
+// SHA-256, used to identify dedup chunks: equal digests are taken to mean
+// equal bytes, so the store never merges two different chunks
+struct Sha256Digest {
+    uint8_t bytes[32];
+    bool operator==(const Sha256Digest &o) const { return memcmp(bytes, o.bytes, sizeof(bytes)) == 0; }
+};
+
+struct Sha256Hasher {
+    size_t operator()(const Sha256Digest &d) const { size_t h; memcpy(&h, d.bytes, sizeof(h)); return h; }
+};
+
+Sha256Digest sha256(const uint8_t *data, size_t size);
@@ -0,0 +1,150 @@
+// dedup.cpp  (content-defined chunking + chunk store)
+#include "dedup.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+struct GearTable {
+    uint64_t t[256];
+    GearTable() {
+        uint64_t x = 0x4B495454595052ull;   // fixed seed: chunking must be identical everywhere
+        for (auto &v : t) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ull);   // splitmix64
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            v = z ^ (z >> 31);
+        }
+    }
+};
+const GearTable gear;
+
+// Normalized chunking: a stricter mask before the average size and a looser
+// one after it pull chunk sizes towards CDC_AVG_CHUNK
+const uint64_t MASK_STRICT = 0xFFFF800000000000ull;   // 17 bits
+const uint64_t MASK_LOOSE  = 0xFFF8000000000000ull;   // 13 bits
+}
+
+size_t findChunkBoundary(const uint8_t *data, size_t size) {
+    if (size <= CDC_MIN_CHUNK) return size;
+    size_t end = min(size, CDC_MAX_CHUNK);
+    size_t normal = min(end, CDC_AVG_CHUNK);
+    uint64_t fp = 0;
+    size_t i = CDC_MIN_CHUNK;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + gear.t[data[i]];
+        if (!(fp & MASK_STRICT)) return i + 1;
+    }
+    for (; i < end; ++i) {
+        fp = (fp << 1) + gear.t[data[i]];
+        if (!(fp & MASK_LOOSE)) return i + 1;
+    }
+    return end;
+}
+
+// ChunkStoreWriter
+
+ChunkStoreWriter::ChunkStoreWriter(OrderedWriter &w, ThreadPool &p, const CompressOptions &o)
+    : writer(w), pool(p), options(o), storeSize(0) {}
+
+uint32_t ChunkStoreWriter::add(const uint8_t *data, size_t size, bool &isNew) {
+    Sha256Digest digest = sha256(data, size);
+    auto it = known.find(digest);
+    if (it != known.end() && table[it->second].size == size) { isNew = false; return it->second; }
+
+    isNew = true;
+    uint32_t id = (uint32_t)table.size();
+    Hash128 h;
+    memcpy(&h.lo, digest.bytes, 8);
+    memcpy(&h.hi, digest.bytes + 8, 8);
+    table.push_back(DedupChunk{ storeSize, (uint32_t)size, h });
+    known[digest] = id;
+    storeSize += size;
+    pending.insert(pending.end(), data, data + size);
+    while (pending.size() >= options.blockSize) queuePending(options.blockSize);
+    return id;
+}
+
+uint64_t ChunkStoreWriter::append(const uint8_t *data, size_t size) {
+    uint64_t at = storeSize;
+    storeSize += size;
+    while (size > 0) {
+        size_t take = min(size, options.blockSize - pending.size());
+        pending.insert(pending.end(), data, data + take);
+        data += take; size -= take;
+        if (pending.size() >= options.blockSize) queuePending(options.blockSize);
+    }
+    return at;
+}
+
+void ChunkStoreWriter::finish() {
+    if (!pending.empty()) queuePending(pending.size());
+}
+
+void ChunkStoreWriter::queuePending(size_t size) {
+    vector<uint8_t> block(pending.begin(), pending.begin() + size);
+    pending.erase(pending.begin(), pending.begin() + size);
+    CompressOptions blockOptions = options;
+    shared_future<vector<uint8_t>> encoded = pool.submit([data = move(block), blockOptions]() {
+        vector<uint8_t> out;
+        compressBlock(data.data(), data.size(), blockOptions, out);
+        return out;
+    }).share();
+    writer.push([encoded]() { return encoded.get(); },
+                [this](uint64_t at, const vector<uint8_t> &bytes) {
+                    index.push_back(BlockIndexEntry{ at, (uint32_t)bytes.size(), parseBlockHeader(bytes.data()).rawSize });
+                });
+}
+
+// ChunkStoreReader
+
+ChunkStoreReader::ChunkStoreReader(istream &stream, const vector<DedupChunk> &c, const vector<BlockIndexEntry> &b,
+                                   const Dictionary *d)
+    : in(stream), chunks(c), blocks(b), dict(d), cachedBlock(SIZE_MAX) {
+    uint64_t at = 0;
+    for (auto &e : blocks) { blockStart.push_back(at); at += e.rawSize; }
+    blockStart.push_back(at);
+}
+
+const vector<uint8_t> &ChunkStoreReader::loadBlock(size_t b) {
+    if (b == cachedBlock) return cached;
+    const BlockIndexEntry &e = blocks[b];
+    if (e.compressedSize < BLOCK_HEADER_SIZE) throw runtime_error("Corrupted chunk store block.");
+    vector<uint8_t> raw(e.compressedSize);
+    in.clear();
+    in.seekg((streamoff)e.offset);
+    in.read(reinterpret_cast<char*>(raw.data()), raw.size());
+    if (!in) throw runtime_error("Truncated chunk store.");
+    BlockHeader header = parseBlockHeader(raw.data());
+    if (BLOCK_HEADER_SIZE + (uint64_t)header.payloadSize != raw.size() || header.rawSize != e.rawSize)
+        throw runtime_error("Chunk store block does not match its index.");
+    cached.clear();
+    decompressBlock(header, raw.data() + BLOCK_HEADER_SIZE, cached, dict);
+    cachedBlock = b;
+    return cached;
+}
+
+void ChunkStoreReader::read(uint32_t id, vector<uint8_t> &out) {
+    if (id >= chunks.size()) throw runtime_error("Corrupted chunk reference.");
+    const DedupChunk &c = chunks[id];
+    out.clear();
+    out.reserve(c.size);
+    readRange(c.storeOffset, c.size, [&out](const uint8_t *data, size_t len) { out.insert(out.end(), data, data + len); });
+}
+
+void ChunkStoreReader::readRange(uint64_t offset, uint64_t size, const function<void(const uint8_t*, size_t)> &emit) {
+    uint64_t pos = offset, end = offset + size;
+    if (end < offset || end > blockStart.back()) throw runtime_error("Corrupted chunk store reference.");
+    // a range may straddle block boundaries
+    size_t b = (size_t)(upper_bound(blockStart.begin(), blockStart.end(), pos) - blockStart.begin()) - 1;
+    while (pos < end) {
+        const vector<uint8_t> &data = loadBlock(b);
+        size_t from = (size_t)(pos - blockStart[b]);
+        size_t len = (size_t)min<uint64_t>(end - pos, data.size() - from);
+        emit(data.data() + from, len);
+        pos += len;
+        ++b;
+    }
+}
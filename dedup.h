@@ -0,0 +1,83 @@
+// dedup.h
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <unordered_map>
+#include <vector>
+#include "block.h"
+#include "checksum.h"
+#include "threadpool.h"
+
+// Content-defined chunking (FastCDC-style gear hash): cut points depend on
+// the bytes around them, so an insertion only disturbs nearby chunks and
+// identical content chunks identically wherever it sits in a file.
+const size_t CDC_MIN_CHUNK = 8 * 1024;
+const size_t CDC_AVG_CHUNK = 32 * 1024;
+const size_t CDC_MAX_CHUNK = 128 * 1024;
+
+// Length of the chunk starting at data. Unless size is the rest of the
+// input, pass at least CDC_MAX_CHUNK bytes so the cut is not premature.
+size_t findChunkBoundary(const uint8_t *data, size_t size);
+
+// One unique chunk: where its bytes sit in the (uncompressed) chunk store
+struct DedupChunk {
+    uint64_t storeOffset;
+    uint32_t size;
+    Hash128 hash;   // first 128 bits of the chunk's SHA-256
+};
+
+// Writer side of the chunk store: unique chunks (or, in solid mode, whole
+// entries) are concatenated, cut into blocks, compressed on the pool and
+// committed through the writer. Block offsets are absolute positions in the
+// writer's stream.
+class ChunkStoreWriter {
+public:
+    ChunkStoreWriter(OrderedWriter &writer, ThreadPool &pool, const CompressOptions &options);
+
+    // Returns the chunk id; isNew tells whether the bytes had to be stored
+    uint32_t add(const uint8_t *data, size_t size, bool &isNew);
+    // Stores bytes as they are (solid mode); returns their store offset
+    uint64_t append(const uint8_t *data, size_t size);
+    void finish();   // queues the last partial block
+    uint64_t size() const { return storeSize; }   // uncompressed store bytes so far
+
+    const std::vector<DedupChunk> &chunks() const { return table; }
+    const std::vector<BlockIndexEntry> &blocks() const { return index; }  // complete once the writer drained
+
+private:
+    OrderedWriter &writer;
+    ThreadPool &pool;
+    CompressOptions options;
+    std::vector<DedupChunk> table;
+    std::unordered_map<Sha256Digest, uint32_t, Sha256Hasher> known;
+    std::vector<uint8_t> pending;   // store bytes not yet cut into a block
+    uint64_t storeSize;
+    std::vector<BlockIndexEntry> index;
+
+    void queuePending(size_t size);
+};
+
+// Reader side: returns chunk bytes, decoding store blocks on demand and
+// keeping the last one, since consecutive chunks mostly share a block
+class ChunkStoreReader {
+public:
+    ChunkStoreReader(std::istream &in, const std::vector<DedupChunk> &chunks,
+                     const std::vector<BlockIndexEntry> &blocks, const Dictionary *dict = nullptr);
+
+    void read(uint32_t id, std::vector<uint8_t> &out);
+    // Emits store bytes [offset, offset + size) in block-sized pieces
+    void readRange(uint64_t offset, uint64_t size, const std::function<void(const uint8_t*, size_t)> &emit);
+    uint64_t size() const { return blockStart.back(); }
+
+private:
+    std::istream &in;
+    const std::vector<DedupChunk> &chunks;
+    const std::vector<BlockIndexEntry> &blocks;
+    const Dictionary *dict;
+    std::vector<uint64_t> blockStart;   // raw store offset of each block
+    size_t cachedBlock;
+    std::vector<uint8_t> cached;
+
+    const std::vector<uint8_t> &loadBlock(size_t b);
+};
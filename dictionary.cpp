@@ -0,0 +1,213 @@
+// dictionary.cpp  (dictionary training, load/save)
+#include "dictionary.h"
+#include "checksum.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+const char DICT_MAGIC[4] = { 'K', 'P', 'D', 'I' };
+const size_t DMER = 8;                     // bytes per scored substring
+const size_t SEGMENT = 128;                // bytes picked at a time
+const unsigned FREQ_BITS = 20;             // dmer frequency table size (hashed)
+const size_t MAX_TRAIN_BYTES = 128 << 20;  // corpus cap for trainDictionaryFile
+const size_t MAX_TABLE_BYTES = 16 << 20;   // samples used to learn the code lengths
+
+inline uint32_t dmerHash(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (uint32_t)((v * 0xCF1BBCDCB7A56463ull) >> (64 - FREQ_BITS));
+}
+
+// Both tables packed back to back, as stored
+vector<uint8_t> packTables(const Dictionary &dict) {
+    vector<uint8_t> packed = packCodeLengths(dict.litLen.lengths);
+    vector<uint8_t> dist = packCodeLengths(dict.dist.lengths);
+    packed.insert(packed.end(), dist.begin(), dist.end());
+    return packed;
+}
+
+// id from the tables and content
+void finishDictionary(Dictionary &dict) {
+    vector<uint8_t> keyed = packTables(dict);
+    keyed.insert(keyed.end(), dict.content.begin(), dict.content.end());
+    dict.id = (uint32_t)hash128(keyed.data(), keyed.size()).lo;
+    if (dict.id == 0) dict.id = 1;
+}
+}
+
+Dictionary trainDictionary(const vector<vector<uint8_t>> &samples, size_t maxSize, int level) {
+    maxSize = min(maxSize, DICT_MAX_SIZE);
+    if (maxSize < SEGMENT) throw runtime_error("Dictionary size too small.");
+
+    vector<uint8_t> corpus;
+    vector<size_t> sampleEnd;
+    for (auto &s : samples) {
+        corpus.insert(corpus.end(), s.begin(), s.end());
+        sampleEnd.push_back(corpus.size());
+    }
+    if (corpus.size() < DMER) throw runtime_error("Not enough sample data to train a dictionary.");
+
+    Dictionary dict;
+    if (corpus.size() <= maxSize) {
+        dict.content = corpus;
+    } else {
+        // Score of a dmer: how many samples contain it. With several samples,
+        // dmers private to one sample cannot help the others and score 0.
+        vector<uint32_t> freq(size_t(1) << FREQ_BITS, 0);
+        vector<uint32_t> lastSample(freq.size(), UINT32_MAX);
+        size_t start = 0;
+        for (size_t i = 0; i < sampleEnd.size(); ++i) {
+            for (size_t p = start; p + DMER <= sampleEnd[i]; ++p) {
+                uint32_t h = dmerHash(&corpus[p]);
+                if (lastSample[h] != (uint32_t)i) { lastSample[h] = (uint32_t)i; freq[h]++; }
+            }
+            start = sampleEnd[i];
+        }
+        if (samples.size() > 1)
+            for (auto &f : freq) if (f < 2) f = 0;
+
+        // One segment per epoch: the window whose distinct dmers score
+        // highest. Picked dmers are zeroed so later epochs add new content.
+        struct Pick { uint64_t score; size_t at; };
+        vector<Pick> picks;
+        vector<uint16_t> inWindow(freq.size(), 0);
+        size_t epochSize = max(SEGMENT, corpus.size() / (maxSize / SEGMENT));
+        for (size_t epoch = 0; epoch + SEGMENT <= corpus.size() && picks.size() < maxSize / SEGMENT;
+             epoch += epochSize) {
+            size_t end = min(corpus.size(), epoch + epochSize);
+            if (end - epoch < SEGMENT) break;
+            uint64_t score = 0, bestScore = 0;
+            size_t best = epoch;
+            const size_t span = SEGMENT - DMER + 1;   // dmers per segment
+            for (size_t p = epoch; p + DMER <= end; ++p) {
+                uint32_t h = dmerHash(&corpus[p]);
+                if (inWindow[h]++ == 0) score += freq[h];
+                if (p >= epoch + span) {
+                    uint32_t old = dmerHash(&corpus[p - span]);
+                    if (--inWindow[old] == 0) score -= freq[old];
+                }
+                if (p + 1 >= epoch + span && score > bestScore) { bestScore = score; best = p + 1 - span; }
+            }
+            for (size_t p = (end - epoch >= span + DMER - 1 ? end - DMER + 1 - span : epoch); p + DMER <= end; ++p)
+                --inWindow[dmerHash(&corpus[p])];
+            if (bestScore == 0) continue;
+            picks.push_back(Pick{ bestScore, best });
+            for (size_t p = best; p + DMER <= best + SEGMENT; ++p) freq[dmerHash(&corpus[p])] = 0;
+        }
+
+        // Best segments go last, where matches from the data are shortest
+        stable_sort(picks.begin(), picks.end(), [](const Pick &a, const Pick &b) { return a.score < b.score; });
+        for (auto &p : picks)
+            dict.content.insert(dict.content.end(), corpus.begin() + p.at, corpus.begin() + p.at + SEGMENT);
+    }
+
+    // Code tables from the tokens the samples produce on the primed window;
+    // every symbol keeps a code so any input can use the tables
+    vector<uint64_t> litLenFreq(LZ_LITLEN_SYMBOLS, 1), distFreq(LZ_DIST_SYMBOLS, 1);
+    size_t used = 0;
+    for (auto &s : samples) {
+        if (used >= MAX_TABLE_BYTES) break;
+        used += s.size();
+        LZ77StreamCompressor lz(65535, 255, level);
+        lz.prime(dict.content.data(), dict.content.size());
+        lz.feed(s.data(), s.size(), true);
+        for (const LZ77Token &t : lz.consumeTokens()) {
+            if (t.length == 0) {
+                litLenFreq[t.lit]++;
+            } else {
+                litLenFreq[256 + lz_length_code(t.length)]++;
+                distFreq[lz_dist_code(t.offset)]++;
+            }
+        }
+    }
+    dict.litLen.build(buildCodeLengths(litLenFreq));
+    dict.dist.build(buildCodeLengths(distFreq));
+    finishDictionary(dict);
+    return dict;
+}
+
+void saveDictionary(const Dictionary &dict, const string &path) {
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out) throw runtime_error("Cannot open dictionary for writing: " + path);
+    uint32_t size = (uint32_t)dict.content.size();
+    vector<uint8_t> packed = packTables(dict);
+    out.write(DICT_MAGIC, 4);
+    out.write(reinterpret_cast<const char*>(&dict.id), 4);
+    out.write(reinterpret_cast<const char*>(&size), 4);
+    out.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+    out.write(reinterpret_cast<const char*>(dict.content.data()), size);
+    out.close();
+    if (!out) throw runtime_error("Failed writing dictionary: " + path);
+}
+
+shared_ptr<const Dictionary> loadDictionary(const string &path) {
+    ifstream in(path, ios::binary);
+    if (!in) throw runtime_error("Cannot open dictionary: " + path);
+    char magic[4];
+    uint32_t id = 0, size = 0;
+    const size_t LITLEN_TABLE = (LZ_LITLEN_SYMBOLS + 1) / 2;
+    uint8_t packed[LITLEN_TABLE + (LZ_DIST_SYMBOLS + 1) / 2];
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char*>(&id), 4);
+    in.read(reinterpret_cast<char*>(&size), 4);
+    in.read(reinterpret_cast<char*>(packed), sizeof(packed));
+    if (!in || memcmp(magic, DICT_MAGIC, 4) != 0 || size > DICT_MAX_SIZE)
+        throw runtime_error("Not a KittyPress dictionary: " + path);
+
+    auto dict = make_shared<Dictionary>();
+    dict->content.resize(size);
+    in.read(reinterpret_cast<char*>(dict->content.data()), size);
+    if ((uint32_t)in.gcount() != size) throw runtime_error("Truncated dictionary: " + path);
+    vector<uint8_t> litLen = unpackCodeLengths(packed, LZ_LITLEN_SYMBOLS);
+    vector<uint8_t> dist = unpackCodeLengths(packed + LITLEN_TABLE, LZ_DIST_SYMBOLS);
+    for (uint8_t len : litLen) if (len == 0) throw runtime_error("Corrupted dictionary code lengths: " + path);
+    for (uint8_t len : dist) if (len == 0) throw runtime_error("Corrupted dictionary code lengths: " + path);
+    dict->litLen.build(litLen);
+    dict->dist.build(dist);
+    finishDictionary(*dict);
+    if (dict->id != id) throw runtime_error("Corrupted dictionary (id mismatch): " + path);
+    return dict;
+}
+
+void trainDictionaryFile(const vector<string> &inputs, const string &outputPath, size_t maxSize) {
+    vector<string> files;
+    for (auto &in : inputs) {
+        if (fs::is_directory(in)) {
+            for (auto &e : fs::recursive_directory_iterator(in))
+                if (fs::is_regular_file(e.path())) files.push_back(e.path().string());
+        } else if (fs::is_regular_file(in)) {
+            files.push_back(in);
+        } else {
+            throw runtime_error("Sample not found: " + in);
+        }
+    }
+    sort(files.begin(), files.end());
+
+    vector<vector<uint8_t>> samples;
+    size_t total = 0;
+    for (auto &path : files) {
+        if (total >= MAX_TRAIN_BYTES) {
+            cout << "Sample limit reached; using the first " << samples.size() << " file(s)\n";
+            break;
+        }
+        ifstream in(path, ios::binary);
+        if (!in) throw runtime_error("Cannot open sample: " + path);
+        vector<uint8_t> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        total += data.size();
+        if (!data.empty()) samples.push_back(move(data));
+    }
+    cout << "Training dictionary from " << samples.size() << " sample(s), " << total << " bytes\n";
+
+    Dictionary dict = trainDictionary(samples, maxSize);
+    saveDictionary(dict, outputPath);
+    cout << "Dictionary written: " << outputPath << " (" << dict.content.size() << " bytes, id "
+         << hex << setw(8) << setfill('0') << dict.id << dec << setfill(' ') << ")\n";
+}
@@ -0,0 +1,34 @@
+// dictionary.h
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "huffman.h"
+
+// Trained dictionary for small inputs. content primes the LZ77 window of
+// every block, so even a tiny input finds matches from its first byte, and
+// the token code tables learned from the samples let a block skip its own.
+// File layout: "KPDI", id u32, content size u32, packed literal/length and
+// distance code lengths (142 + 16 bytes, every symbol coded), content.
+const size_t DICT_DEFAULT_SIZE = 32 * 1024;
+const size_t DICT_MAX_SIZE = 60 * 1024;   // leaves part of the 64 KiB window to the data itself
+
+struct Dictionary {
+    uint32_t id = 0;                    // hash of tables + content, recorded by every stream using it
+    std::vector<uint8_t> content;
+    HuffmanTable litLen;                // LZ_LITLEN_SYMBOLS entries
+    HuffmanTable dist;                  // LZ_DIST_SYMBOLS entries
+};
+
+std::shared_ptr<const Dictionary> loadDictionary(const std::string &path);
+void saveDictionary(const Dictionary &dict, const std::string &path);
+
+// Picks the most common segments of samples (FastCover-style: each epoch
+// of the corpus contributes its best-scoring segment), at most maxSize bytes
+Dictionary trainDictionary(const std::vector<std::vector<uint8_t>> &samples, size_t maxSize,
+                           int level = LZ77_DEFAULT_LEVEL);
+
+// `kittypress train`: every file under inputs is one sample
+void trainDictionaryFile(const std::vector<std::string> &inputs, const std::string &outputPath,
+                         size_t maxSize = DICT_DEFAULT_SIZE);
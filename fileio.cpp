@@ -0,0 +1,146 @@
+// fileio.cpp
+#include "fileio.h"
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KITTY_POSIX_IO 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile(const string &path) : base(nullptr), length(0) {
+#ifdef KITTY_POSIX_IO
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            base = static_cast<const uint8_t*>(p);
+            length = (uint64_t)st.st_size;
+        }
+    }
+    ::close(fd);   // the mapping stays valid
+#else
+    (void)path;
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef KITTY_POSIX_IO
+    if (base) munmap(const_cast<uint8_t*>(base), (size_t)length);
+#endif
+}
+
+// OutputFile
+
+OutputFile::OutputFile(const string &p) : path(p), fd(-1) {
+#ifdef KITTY_POSIX_IO
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) return;
+#endif
+    stream.open(path, ios::in | ios::out | ios::binary | ios::trunc);
+    if (!stream.is_open()) throw runtime_error("Cannot open output file for writing: " + path);
+}
+
+OutputFile::~OutputFile() {
+#ifdef KITTY_POSIX_IO
+    if (fd >= 0) ::close(fd);
+#endif
+}
+
+void OutputFile::resize(uint64_t size) {
+#ifdef KITTY_POSIX_IO
+    if (fd >= 0) {
+        if (ftruncate(fd, (off_t)size) != 0) throw runtime_error("Cannot resize output file: " + path);
+        return;
+    }
+#endif
+    // streams cannot truncate; extending happens on the first write past the end
+    (void)size;
+}
+
+void OutputFile::writeAt(uint64_t offset, const uint8_t *data, size_t size) {
+#ifdef KITTY_POSIX_IO
+    if (fd >= 0) {
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, (off_t)offset);
+            if (n <= 0) throw runtime_error("Failed writing output file: " + path);
+            data += n; size -= (size_t)n; offset += (uint64_t)n;
+        }
+        return;
+    }
+#endif
+    lock_guard<mutex> lock(streamMutex);
+    stream.seekp((streamoff)offset);
+    stream.write(reinterpret_cast<const char*>(data), size);
+    if (!stream) throw runtime_error("Failed writing output file: " + path);
+}
+
+void OutputFile::close() {
+#ifdef KITTY_POSIX_IO
+    if (fd >= 0) {
+        int rc = ::close(fd);
+        fd = -1;
+        if (rc != 0) throw runtime_error("Failed writing output file: " + path);
+        return;
+    }
+#endif
+    if (stream.is_open()) {
+        stream.close();
+        if (!stream) throw runtime_error("Failed writing output file: " + path);
+    }
+}
+
+// OutputFileBuf
+
+OutputFileBuf::OutputFileBuf(OutputFile &f, uint64_t start) : file(f), pos(start), buffer(1 << 20) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+OutputFileBuf::~OutputFileBuf() {
+    try { sync(); } catch (...) {}
+}
+
+uint64_t OutputFileBuf::position() {
+    return pos + (uint64_t)(pptr() - pbase());
+}
+
+int OutputFileBuf::sync() {
+    size_t pending = (size_t)(pptr() - pbase());
+    if (pending > 0) {
+        file.writeAt(pos, reinterpret_cast<const uint8_t*>(pbase()), pending);
+        pos += pending;
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+    return 0;
+}
+
+OutputFileBuf::int_type OutputFileBuf::overflow(int_type ch) {
+    sync();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+streamsize OutputFileBuf::xsputn(const char *s, streamsize n) {
+    size_t len = (size_t)n;
+    if (len <= (size_t)(epptr() - pptr())) {
+        memcpy(pptr(), s, len);
+        pbump((int)len);
+        return n;
+    }
+    // large writes bypass the buffer
+    sync();
+    file.writeAt(pos, reinterpret_cast<const uint8_t*>(s), len);
+    pos += len;
+    return n;
+}
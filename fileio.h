@@ -0,0 +1,69 @@
+// fileio.h
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Read-only map of a whole file (mmap on POSIX). Elsewhere, or when mapping
+// fails (empty file, special file), valid() is false and callers fall back
+// to streams.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool valid() const { return base != nullptr; }
+    const uint8_t *data() const { return base; }
+    uint64_t size() const { return length; }
+
+private:
+    const uint8_t *base;
+    uint64_t length;
+};
+
+// Output file written at explicit offsets, safely from several threads
+// (pwrite on POSIX; elsewhere an fstream behind a mutex).
+class OutputFile {
+public:
+    explicit OutputFile(const std::string &path);  // creates or truncates
+    ~OutputFile();
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    void resize(uint64_t size);
+    void writeAt(uint64_t offset, const uint8_t *data, size_t size);
+    void close();  // throws if anything failed to reach the file
+
+private:
+    std::string path;
+    int fd;
+    std::fstream stream;
+    std::mutex streamMutex;
+};
+
+// Sequential ostream adapter over an OutputFile, for the decoders that
+// produce output in order. position() is where the next byte lands.
+class OutputFileBuf : public std::streambuf {
+public:
+    OutputFileBuf(OutputFile &file, uint64_t start = 0);
+    ~OutputFileBuf();
+
+    uint64_t position();
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    OutputFile &file;
+    uint64_t pos;               // file offset of buffer[0]
+    std::vector<char> buffer;
+};
@@ -0,0 +1,129 @@
+// fse.cpp  (tANS tables: normalization, description, encoder/decoder setup)
+#include "fse.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+// Spreads each symbol's states across the table (every state exactly once,
+// since the step is odd), so a symbol's states are not clustered
+vector<uint16_t> spreadSymbols(const vector<uint16_t> &norm, unsigned tableLog) {
+    const uint32_t size = 1u << tableLog, mask = size - 1;
+    const uint32_t step = (size >> 1) + (size >> 3) + 3;
+    vector<uint16_t> spread(size);
+    uint32_t pos = 0;
+    for (size_t s = 0; s < norm.size(); ++s)
+        for (unsigned i = 0; i < norm[s]; ++i) {
+            spread[pos] = (uint16_t)s;
+            pos = (pos + step) & mask;
+        }
+    return spread;
+}
+}
+
+vector<uint16_t> fseNormalize(const vector<uint64_t> &freq, unsigned tableLog) {
+    const uint32_t size = 1u << tableLog;
+    uint64_t total = 0;
+    for (uint64_t f : freq) total += f;
+    if (total == 0) throw runtime_error("FSE table needs at least one symbol.");
+
+    vector<uint16_t> norm(freq.size(), 0);
+    int64_t sum = 0;
+    for (size_t s = 0; s < freq.size(); ++s) {
+        if (freq[s] == 0) continue;
+        norm[s] = (uint16_t)max<uint64_t>(1, (freq[s] * size + total / 2) / total);
+        sum += norm[s];
+    }
+    // Rounding leaves the sum off by a little; the largest counts absorb it,
+    // where a step changes the cost per symbol the least
+    vector<size_t> bySize;
+    for (size_t s = 0; s < norm.size(); ++s) if (norm[s] > 0) bySize.push_back(s);
+    sort(bySize.begin(), bySize.end(), [&norm](size_t a, size_t b) { return norm[a] > norm[b]; });
+    for (size_t i = 0; sum != (int64_t)size; i = (i + 1) % bySize.size()) {
+        uint16_t &n = norm[bySize[i]];
+        if (sum < (int64_t)size) {
+            n += (uint16_t)((int64_t)size - sum);
+            sum = size;
+        } else {
+            int64_t take = min<int64_t>(sum - (int64_t)size, max<int64_t>(1, n / 4));
+            take = min<int64_t>(take, n - 1);
+            n -= (uint16_t)take;
+            sum -= take;
+        }
+    }
+    return norm;
+}
+
+uint64_t fseCost(const vector<uint64_t> &freq, const vector<uint16_t> &norm, unsigned tableLog) {
+    double bits = 0;
+    for (size_t s = 0; s < freq.size(); ++s)
+        if (freq[s] > 0) bits += (double)freq[s] * (tableLog - log2((double)norm[s]));
+    return (uint64_t)bits + 1;
+}
+
+vector<uint16_t> fseReadCounts(BitReader &reader, size_t symbols, unsigned tableLog) {
+    vector<uint16_t> norm(symbols, 0);
+    uint32_t remaining = 1u << tableLog;
+    for (size_t s = 0; remaining > 0; ++s) {
+        if (s >= symbols) throw runtime_error("Corrupted FSE table.");
+        reader.refill();
+        unsigned nbits = fse_log2(remaining) + 1;
+        uint32_t count = reader.peekBits(nbits);
+        reader.skipBits(nbits);
+        if (count > remaining) throw runtime_error("Corrupted FSE table.");
+        norm[s] = (uint16_t)count;
+        remaining -= count;
+        if (count != 0) continue;
+        for (;;) {
+            reader.refill();
+            uint32_t run = reader.peekBits(2);
+            reader.skipBits(2);
+            s += run;
+            if (run < 3) break;
+        }
+    }
+    if (reader.overrun()) throw runtime_error("Corrupted FSE table.");
+    return norm;
+}
+
+FseEncoder::FseEncoder(const vector<uint16_t> &norm, unsigned log)
+    : tableLog(log), state(1u << log), transform(norm.size()), stateTable(size_t(1) << log) {
+    const uint32_t size = 1u << tableLog;
+    vector<uint32_t> cumul(norm.size() + 1, 0);
+    for (size_t s = 0; s < norm.size(); ++s) cumul[s + 1] = cumul[s] + norm[s];
+
+    // A symbol's k-th state in table order is the one its decoder entry
+    // reaches from (state >> bits) == norm + k
+    vector<uint16_t> spread = spreadSymbols(norm, tableLog);
+    vector<uint32_t> next(cumul.begin(), cumul.end() - 1);
+    for (uint32_t u = 0; u < size; ++u) stateTable[next[spread[u]]++] = (uint16_t)(size + u);
+
+    for (size_t s = 0; s < norm.size(); ++s) {
+        uint32_t c = norm[s];
+        if (c == 0) continue;
+        Transform &t = transform[s];
+        if (c == 1) {
+            t.deltaBits = (tableLog << 16) - size;
+        } else {
+            unsigned maxBits = tableLog - fse_log2(c - 1);
+            t.deltaBits = (maxBits << 16) - (c << maxBits);
+        }
+        t.firstState = (int32_t)cumul[s] - (int32_t)c;
+    }
+}
+
+void FseDecoder::build(const vector<uint16_t> &norm, unsigned log) {
+    tableLog = log;
+    const uint32_t size = 1u << tableLog;
+    vector<uint16_t> spread = spreadSymbols(norm, tableLog);
+    vector<uint32_t> next(norm.begin(), norm.end());
+    table.resize(size);
+    for (uint32_t u = 0; u < size; ++u) {
+        uint16_t s = spread[u];
+        uint32_t n = next[s]++;
+        unsigned bits = tableLog - fse_log2(n);
+        table[u] = Entry{ (uint16_t)((n << bits) - size), s, (uint8_t)bits };
+    }
+}
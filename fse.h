@@ -0,0 +1,109 @@
+// fse.h
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "bitstream.h"
+
+// Table-based asymmetric numeral system coder (tANS, as in FSE). With
+// symbol counts normalized to 1 << tableLog, a symbol of count c costs
+// tableLog - log2(c) bits, fractions included, where a Huffman code rounds
+// every symbol to whole bits (and at least 1).
+// The encoder runs over the symbols backwards; FseBitStack collects its
+// output and writes it out reversed, so the decoder reads forwards.
+const unsigned FSE_MAX_TABLE_LOG = 12;
+
+inline unsigned fse_log2(uint32_t v) {   // v > 0
+    unsigned n = 0;
+    while (v >>= 1) ++n;
+    return n;
+}
+
+// Scales freq to counts summing to 1 << tableLog; every used symbol keeps
+// a count of at least 1. freq must not be all zero.
+std::vector<uint16_t> fseNormalize(const std::vector<uint64_t> &freq, unsigned tableLog);
+
+// Estimated bits to code freq with the normalized counts (table excluded)
+uint64_t fseCost(const std::vector<uint64_t> &freq, const std::vector<uint16_t> &norm, unsigned tableLog);
+
+// Table description: each count in just enough bits for what is left of
+// the table, a zero followed by the length of the zero run in 2-bit steps
+// (3 = more follow); stops once the counts add up
+template <class Writer>
+void fseWriteCounts(Writer &writer, const std::vector<uint16_t> &norm, unsigned tableLog) {
+    uint32_t remaining = 1u << tableLog;
+    for (size_t s = 0; remaining > 0; ++s) {
+        writer.writeBits(norm[s], fse_log2(remaining) + 1);
+        remaining -= norm[s];
+        if (norm[s] != 0) continue;
+        size_t run = 0;
+        while (norm[s + 1 + run] == 0) ++run;   // a used symbol follows while remaining > 0
+        s += run;
+        for (; run >= 3; run -= 3) writer.writeBits(3, 2);
+        writer.writeBits(run, 2);
+    }
+}
+
+// Reads a table description for an alphabet of symbols entries
+std::vector<uint16_t> fseReadCounts(BitReader &reader, size_t symbols, unsigned tableLog);
+
+// Counts bits instead of writing them (sizes a table description)
+struct BitCounter {
+    uint64_t bits = 0;
+    void writeBits(uint64_t, unsigned nbits) { bits += nbits; }
+};
+
+// Bit fields pushed in reverse decoding order
+class FseBitStack {
+public:
+    void reserve(size_t fields) { fields_.reserve(fields); }
+    // value < 1 << nbits, nbits <= 32
+    void push(uint32_t value, unsigned nbits) { if (nbits) fields_.push_back((uint64_t(value) << 8) | nbits); }
+    void writeTo(BitWriter &writer) const {
+        for (size_t i = fields_.size(); i-- > 0;) writer.writeBits(fields_[i] >> 8, unsigned(fields_[i] & 0xFF));
+    }
+
+private:
+    std::vector<uint64_t> fields_;
+};
+
+class FseEncoder {
+public:
+    FseEncoder(const std::vector<uint16_t> &norm, unsigned tableLog);
+
+    // Pushes the state bits that let the decoder step past symbol
+    inline void encode(FseBitStack &bits, unsigned symbol) {
+        const Transform &t = transform[symbol];
+        unsigned nbits = (state + t.deltaBits) >> 16;
+        bits.push(state & ((1u << nbits) - 1), nbits);
+        state = stateTable[t.firstState + (state >> nbits)];
+    }
+    // The final state, which the decoder reads first
+    void finish(FseBitStack &bits) const { bits.push(state - (1u << tableLog), tableLog); }
+
+private:
+    struct Transform {
+        uint32_t deltaBits;    // (state + deltaBits) >> 16 = bits to flush
+        int32_t firstState;    // stateTable index of (state >> bits) == 0
+    };
+    unsigned tableLog;
+    uint32_t state;
+    std::vector<Transform> transform;
+    std::vector<uint16_t> stateTable;
+};
+
+class FseDecoder {
+public:
+    struct Entry {
+        uint16_t base;     // next state, before adding the bits read
+        uint16_t symbol;
+        uint8_t bits;
+    };
+
+    void build(const std::vector<uint16_t> &norm, unsigned tableLog);
+    unsigned log() const { return tableLog; }
+    const Entry &operator[](uint32_t state) const { return table[state]; }
+
+private:
+    unsigned tableLog = 0;
+    std::vector<Entry> table;
+};
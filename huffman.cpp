@@ -3,6 +3,11 @@
 #include "bitstream.h"
 #include "kitty.h"
 #include "lz77.h"
+#include "block.h"
+#include "threadpool.h"
+#include "memstream.h"
+#include "fileio.h"
+#include "dictionary.h"
 #include <iostream>
 #include <bitset>
 #include <iomanip>
@@ -12,463 +17,577 @@
 #include <sstream>
 #include <array>
 #include <cmath>
+#include <cstring>
+#include <deque>
+#include <future>
 
 using namespace std;
 namespace fs = std::filesystem;
 
-void buildCodes(HuffmanNode* root, const string &str, unordered_map<unsigned char, string> &huffmanCode) {
-    if (!root) return;
-    if (!root->left && !root->right) {
-        huffmanCode[root->ch] = (str.empty() ? "0" : str);
-        return;
+vector<uint8_t> buildCodeLengths(const vector<uint64_t> &freq, unsigned maxBits) {
+    vector<uint8_t> lengths(freq.size(), 0);
+    vector<uint32_t> syms;
+    for (uint32_t s = 0; s < freq.size(); ++s)
+        if (freq[s] > 0) syms.push_back(s);
+    if (syms.empty()) return lengths;
+    if (syms.size() == 1) { lengths[syms[0]] = 1; return lengths; }
+
+    // Plain Huffman merge over leaf ids [0, m) and internal ids [m, 2m-1).
+    // Ties break on node id so the result is deterministic.
+    const size_t m = syms.size();
+    vector<uint32_t> parent(2 * m - 1, 0);
+    typedef pair<uint64_t, uint32_t> Item;
+    priority_queue<Item, vector<Item>, greater<Item>> pq;
+    for (uint32_t i = 0; i < m; ++i) pq.push(Item(freq[syms[i]], i));
+    uint32_t next = (uint32_t)m;
+    while (pq.size() > 1) {
+        Item a = pq.top(); pq.pop();
+        Item b = pq.top(); pq.pop();
+        parent[a.second] = parent[b.second] = next;
+        pq.push(Item(a.first + b.first, next++));
+    }
+    vector<unsigned> depth(2 * m - 1, 0);
+    for (size_t id = 2 * m - 2; id-- > 0;) depth[id] = depth[parent[id]] + 1;
+
+    vector<unsigned> len(m);
+    unsigned maxLen = 0;
+    for (size_t i = 0; i < m; ++i) { len[i] = depth[i]; maxLen = max(maxLen, len[i]); }
+
+    if (maxLen > maxBits) {
+        // Clamp, then restore the Kraft inequality by lengthening the rarest
+        // codes, then spend any leftover code space on the most frequent ones.
+        vector<uint32_t> byFreq(m);
+        for (uint32_t i = 0; i < m; ++i) byFreq[i] = i;
+        stable_sort(byFreq.begin(), byFreq.end(),
+                    [&](uint32_t a, uint32_t b) { return freq[syms[a]] < freq[syms[b]]; });
+
+        const uint64_t limit = uint64_t(1) << maxBits;
+        uint64_t kraft = 0;
+        for (auto &l : len) {
+            l = min(l, maxBits);
+            kraft += uint64_t(1) << (maxBits - l);
+        }
+        while (kraft > limit) {
+            for (uint32_t i : byFreq) {
+                if (len[i] < maxBits) {
+                    kraft -= uint64_t(1) << (maxBits - len[i] - 1);
+                    len[i]++;
+                    break;
+                }
+            }
+        }
+        for (auto it = byFreq.rbegin(); it != byFreq.rend(); ++it) {
+            while (len[*it] > 1 && kraft + (uint64_t(1) << (maxBits - len[*it])) <= limit) {
+                kraft += uint64_t(1) << (maxBits - len[*it]);
+                len[*it]--;
+            }
+        }
     }
-    if (root->left) buildCodes(root->left, str + "0", huffmanCode);
-    if (root->right) buildCodes(root->right, str + "1", huffmanCode);
-}
 
-void freeTree(HuffmanNode* root) {
-    if (!root) return;
-    freeTree(root->left);
-    freeTree(root->right);
-    delete root;
+    for (size_t i = 0; i < m; ++i) lengths[syms[i]] = (uint8_t)len[i];
+    return lengths;
 }
 
-void storeRawFile(const string &inputPath, const string &outputPath) {
-    ifstream in(inputPath, ios::binary);
-    if (!in.is_open()) throw runtime_error("Cannot open input file.");
-
-    vector<uint8_t> buffer((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
-    in.close();
+vector<uint32_t> canonicalCodes(const vector<uint8_t> &lengths) {
+    array<uint32_t, HUFFMAN_MAX_BITS + 2> count = {};
+    for (uint8_t l : lengths) {
+        if (l > HUFFMAN_MAX_BITS) throw runtime_error("Huffman code length out of range.");
+        count[l]++;
+    }
+    count[0] = 0;
+    array<uint32_t, HUFFMAN_MAX_BITS + 2> nextCode = {};
+    uint32_t code = 0;
+    for (unsigned bits = 1; bits <= HUFFMAN_MAX_BITS; ++bits) {
+        code = (code + count[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+    vector<uint32_t> codes(lengths.size(), 0);
+    for (size_t s = 0; s < lengths.size(); ++s)
+        if (lengths[s]) codes[s] = nextCode[lengths[s]]++;
+    return codes;
+}
 
-    ofstream out(outputPath, ios::binary);
-    if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
+vector<uint8_t> packCodeLengths(const vector<uint8_t> &lengths) {
+    vector<uint8_t> packed((lengths.size() + 1) / 2, 0);
+    for (size_t s = 0; s < lengths.size(); ++s)
+        packed[s / 2] |= (s & 1) ? (lengths[s] & 0x0F) : uint8_t(lengths[s] << 4);
+    return packed;
+}
 
-    out.write(KITTY_MAGIC_V3.c_str(), KITTY_MAGIC_V3.size());
-    bool isCompressed = false;
-    out.write(reinterpret_cast<const char*>(&isCompressed), sizeof(isCompressed));
+vector<uint8_t> unpackCodeLengths(const uint8_t *packed, size_t count) {
+    vector<uint8_t> lengths(count);
+    for (size_t s = 0; s < count; ++s)
+        lengths[s] = (s & 1) ? (packed[s / 2] & 0x0F) : (packed[s / 2] >> 4);
+    return lengths;
+}
 
-    string ext = filesystem::path(inputPath).extension().string();
-    uint64_t extLen = ext.size();
-    out.write(reinterpret_cast<const char*>(&extLen), sizeof(extLen));
-    if (extLen > 0) out.write(ext.c_str(), extLen);
+// HuffmanDecoder
+
+void HuffmanDecoder::buildFromCodes(const unordered_map<unsigned char, string> &codes) {
+    vector<Code> list;
+    list.reserve(codes.size());
+    for (auto &p : codes) {
+        const string &str = p.second;
+        if (str.empty() || str.size() > 64) throw runtime_error("Unsupported Huffman code length in header.");
+        Code c{ p.first, 0, (unsigned)str.size() };
+        for (char b : str) c.bits = (c.bits << 1) | (b == '1' ? 1 : 0);
+        list.push_back(c);
+    }
+    build(list);
+}
 
-    uint64_t rawSize = buffer.size();
-    out.write(reinterpret_cast<const char*>(&rawSize), sizeof(rawSize));
-    if (rawSize > 0) out.write(reinterpret_cast<const char*>(buffer.data()), rawSize);
+void HuffmanDecoder::buildFromLengths(const vector<uint8_t> &lengths) {
+    vector<uint32_t> values = canonicalCodes(lengths);
+    vector<Code> list;
+    for (uint32_t s = 0; s < lengths.size(); ++s)
+        if (lengths[s]) list.push_back(Code{ s, values[s], lengths[s] });
+    build(list);
+}
 
-    out.close();
+void HuffmanDecoder::build(const vector<Code> &codes) {
+    table.clear();
+    if (codes.empty()) {
+        // nothing can be decoded; every lookup hits an INVALID entry
+        rootBits = 1;
+        table.assign(2, Entry{ 0, 0, INVALID });
+        return;
+    }
+    buildLevel(codes, 0, rootBits);
 }
 
-void restoreRawFile(std::ifstream &inStream, const string &outputPath) {
-    uint64_t rawSize;
-    inStream.read(reinterpret_cast<char*>(&rawSize), sizeof(rawSize));
-    if (!inStream.good()) throw runtime_error("Failed to read raw size.");
-    vector<char> buffer;
-    buffer.resize(rawSize);
-    if (rawSize > 0) {
-        inStream.read(reinterpret_cast<char*>(buffer.data()), rawSize);
-        if ((uint64_t)inStream.gcount() != rawSize) {
-            throw runtime_error("Unexpected EOF while reading raw payload.");
+// Builds the table for all codes sharing the `consumed` leading bits already
+// resolved by parent tables; returns its offset and width in `width`.
+uint32_t HuffmanDecoder::buildLevel(const vector<Code> &codes, unsigned consumed, unsigned &width) {
+    unsigned maxLen = 0;
+    for (auto &c : codes) maxLen = max(maxLen, c.len - consumed);
+    width = min(maxLen, TABLE_BITS);
+
+    uint32_t offset = (uint32_t)table.size();
+    table.resize(table.size() + (size_t(1) << width), Entry{ 0, 0, INVALID });
+
+    vector<vector<Code>> longer(size_t(1) << width);
+    for (auto &c : codes) {
+        unsigned rem = c.len - consumed;
+        uint64_t restBits = rem >= 64 ? c.bits : (c.bits & ((uint64_t(1) << rem) - 1));
+        if (rem <= width) {
+            size_t first = size_t(restBits) << (width - rem);
+            size_t span = size_t(1) << (width - rem);
+            for (size_t k = first; k < first + span; ++k) {
+                if (table[offset + k].kind != INVALID) throw runtime_error("Huffman code table is not prefix-free.");
+                table[offset + k] = Entry{ c.symbol, (uint8_t)rem, SYMBOL };
+            }
+        } else {
+            longer[size_t(restBits >> (rem - width))].push_back(c);
         }
     }
-    ofstream out(outputPath, ios::binary);
-    if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
-    if (rawSize > 0) out.write(buffer.data(), rawSize);
-    out.close();
+
+    for (size_t k = 0; k < longer.size(); ++k) {
+        if (longer[k].empty()) continue;
+        if (table[offset + k].kind != INVALID) throw runtime_error("Huffman code table is not prefix-free.");
+        unsigned subWidth = 0;
+        uint32_t sub = buildLevel(longer[k], consumed + width, subWidth);
+        table[offset + k] = Entry{ sub, (uint8_t)subWidth, SUBTABLE };
+    }
+    return offset;
 }
 
-// compressFile: two-pass streamed approach (LZ77 streaming -> .lz77 tmp -> Huffman scan + encode)
-void compressFile(const string &inputPath, const string &outputPath) {
-    const size_t READ_CHUNK = 64 * 1024;
-    const size_t ENTROPY_SAMPLE = 1024 * 1024; // 1 MiB
-    const double ENTROPY_SKIP_THRESHOLD = 7.7; // bits/byte threshold to skip compression
+// Reads a legacy (byte, uint64 len, '0'/'1' string) code map
+static HuffmanDecoder readCodeMap(istream &in) {
+    uint64_t mapSize = 0;
+    in.read(reinterpret_cast<char*>(&mapSize), sizeof(mapSize));
+    if (!in || mapSize > 256) throw runtime_error("Corrupted Huffman code map.");
+    unordered_map<unsigned char, string> huffmanCode;
+    for (uint64_t i = 0; i < mapSize; ++i) {
+        unsigned char c; uint64_t len;
+        in.read(reinterpret_cast<char*>(&c), sizeof(c));
+        in.read(reinterpret_cast<char*>(&len), sizeof(len));
+        if (!in || len > 64) throw runtime_error("Corrupted Huffman code map.");
+        string code(len, '\0');
+        in.read(&code[0], len);
+        huffmanCode[c] = code;
+    }
+    HuffmanDecoder decoder;
+    decoder.buildFromCodes(huffmanCode);
+    return decoder;
+}
 
-    if (!fs::exists(inputPath)) throw runtime_error("Input not found.");
+// Decodes encodedLen bits of Huffman payload that follow the code table (shared by KP01/KP02/KP03),
+// handing the symbols to emit in chunks
+static void decodeHuffmanPayload(istream &in, const HuffmanDecoder &decoder,
+                                 const function<void(const uint8_t*, size_t)> &emit) {
+    const size_t EMIT_CHUNK = 64 * 1024;
+    uint64_t encodedLen = 0;
+    in.read(reinterpret_cast<char*>(&encodedLen), sizeof(encodedLen));
 
-    ifstream in(inputPath, ios::binary);
-    if (!in.is_open()) throw runtime_error("Cannot open input file.");
+    BitReader reader(in);
+    vector<uint8_t> decoded;
+    decoded.reserve(EMIT_CHUNK);
+    while (reader.bitsConsumed() < encodedLen) {
+        uint32_t sym = decoder.decode(reader);
+        // a code running past encodedLen (or past EOF) is padding, not data
+        if (reader.bitsConsumed() > encodedLen || reader.overrun()) break;
+        decoded.push_back((uint8_t)sym);
+        if (decoded.size() == EMIT_CHUNK) { emit(decoded.data(), decoded.size()); decoded.clear(); }
+    }
+    if (!decoded.empty()) emit(decoded.data(), decoded.size());
+}
 
-    // compute original size
-    uint64_t originalSize = (uint64_t)fs::file_size(inputPath);
+static function<void(const uint8_t*, size_t)> writeTo(ostream &out) {
+    return [&out](const uint8_t *data, size_t size) { out.write(reinterpret_cast<const char*>(data), size); };
+}
 
-    // Smart-skip: quick entropy estimate on first up-to-ENTROPY_SAMPLE bytes 
-    {
-        size_t sampleLen = (size_t)min<uint64_t>(ENTROPY_SAMPLE, originalSize);
-        if (sampleLen > 0) {
-            vector<uint8_t> sample;
-            sample.resize(sampleLen);
-            in.read(reinterpret_cast<char*>(sample.data()), (std::streamsize)sampleLen);
-            streamsize got = in.gcount();
-            sample.resize((size_t)got);
-
-            if (got > 0) {
-                array<uint64_t, 256> freq = {};
-                freq.fill(0);
-                for (uint8_t b : sample) freq[b]++;
-
-                double entropy = 0.0;
-                const double N = (double)got;
-                for (int i = 0; i < 256; ++i) {
-                    if (freq[i] == 0) continue;
-                    double p = (double)freq[i] / N;
-                    entropy -= p * log2(p);
-                }
+void storeRawStream(istream &in, uint64_t size, ostream &out, const string &ext) {
+    const size_t COPY_CHUNK = 1 << 20;
+    out.write(KITTY_MAGIC_V5.c_str(), KITTY_MAGIC_V5.size());
+    bool isCompressed = false;
+    out.write(reinterpret_cast<const char*>(&isCompressed), sizeof(isCompressed));
 
-                cout << fixed << setprecision(3);
-                if (entropy >= ENTROPY_SKIP_THRESHOLD) {
-                    cout << "\n⚡ Smart Skip: High-entropy file detected (H=" << entropy
-                         << " bits/byte) — skipping compression and storing raw.\n";
-                    in.close();
-                    storeRawFile(inputPath, outputPath);
-                    return;
-                } else {
-                    cout << "\nℹ️ Entropy check: H=" << entropy << " bits/byte — will attempt compression.\n";
-                }
-            }
-            // rewind stream for normal processing
-            in.clear();
-            in.seekg(0, ios::beg);
-        }
-    }
+    uint64_t extLen = ext.size();
+    out.write(reinterpret_cast<const char*>(&extLen), sizeof(extLen));
+    if (extLen > 0) out.write(ext.c_str(), extLen);
 
-    fs::path outPath(outputPath);
-    fs::path tmpLzPath = outPath.string() + ".lz77.tmp";
-    try { if (fs::exists(tmpLzPath)) fs::remove(tmpLzPath); } catch(...) {}
-
-    ofstream lzOut(tmpLzPath, ios::binary);
-    if (!lzOut.is_open()) { in.close(); throw runtime_error("Cannot open temporary LZ77 output file for writing."); }
-
-    LZ77StreamCompressor lzstream;
-    unordered_map<unsigned char, uint64_t> freq;
-
-    // feed chunks
-    vector<uint8_t> buf;
-    buf.reserve(READ_CHUNK);
-    while (true) {
-        buf.clear();
-        buf.resize(READ_CHUNK);
-        in.read(reinterpret_cast<char*>(buf.data()), (std::streamsize)READ_CHUNK);
-        streamsize got = in.gcount();
-        if (got <= 0) break;
-        buf.resize((size_t)got);
-        lzstream.feed(buf, false);
-        auto outBytes = lzstream.consumeOutput();
-        if (!outBytes.empty()) {
-            lzOut.write(reinterpret_cast<const char*>(outBytes.data()), outBytes.size());
-            for (uint8_t b : outBytes) freq[static_cast<unsigned char>(b)]++;
-        }
-        if (got < (streamsize)READ_CHUNK) break;
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    vector<char> buffer((size_t)min<uint64_t>(COPY_CHUNK, size));
+    for (uint64_t remaining = size; remaining > 0; ) {
+        size_t len = (size_t)min<uint64_t>(buffer.size(), remaining);
+        in.read(buffer.data(), len);
+        if ((size_t)in.gcount() != len) throw runtime_error("Input changed size while storing.");
+        out.write(buffer.data(), len);
+        remaining -= len;
     }
+    if (!out) throw runtime_error("Failed writing output stream.");
+}
 
-    // finalize
-    lzstream.feed(vector<uint8_t>(), true);
-    auto finalBytes = lzstream.consumeOutput();
-    if (!finalBytes.empty()) {
-        lzOut.write(reinterpret_cast<const char*>(finalBytes.data()), finalBytes.size());
-        for (uint8_t b : finalBytes) freq[static_cast<unsigned char>(b)]++;
+void restoreRawStream(istream &in, ostream &out) {
+    const size_t COPY_CHUNK = 1 << 20;
+    uint64_t rawSize;
+    in.read(reinterpret_cast<char*>(&rawSize), sizeof(rawSize));
+    if (!in.good()) throw runtime_error("Failed to read raw size.");
+    vector<char> buffer((size_t)min<uint64_t>(COPY_CHUNK, rawSize));
+    for (uint64_t remaining = rawSize; remaining > 0; ) {
+        size_t len = (size_t)min<uint64_t>(buffer.size(), remaining);
+        in.read(buffer.data(), len);
+        if ((size_t)in.gcount() != len) throw runtime_error("Unexpected EOF while reading raw payload.");
+        out.write(buffer.data(), len);
+        remaining -= len;
     }
+}
 
-    in.close();
-    lzOut.flush();
-    lzOut.close();
+void storeRawFile(const string &inputPath, const string &outputPath) {
+    ifstream in(inputPath, ios::binary);
+    if (!in.is_open()) throw runtime_error("Cannot open input file.");
+    ofstream out(outputPath, ios::binary);
+    if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
+    storeRawStream(in, (uint64_t)fs::file_size(inputPath), out, fs::path(inputPath).extension().string());
+}
 
-    if (freq.empty()) {
-        try { fs::remove(tmpLzPath); } catch(...) {}
-        storeRawFile(inputPath, outputPath);
-        return;
+double sampleEntropy(const uint8_t *data, size_t size) {
+    const size_t ENTROPY_SAMPLE = 1024 * 1024; // 1 MiB
+    size_t sampleLen = min(ENTROPY_SAMPLE, size);
+    if (sampleLen == 0) return 0.0;
+
+    array<uint64_t, 256> freq = {};
+    for (size_t i = 0; i < sampleLen; ++i) freq[data[i]]++;
+
+    double entropy = 0.0;
+    const double N = (double)sampleLen;
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] == 0) continue;
+        double p = (double)freq[i] / N;
+        entropy -= p * log2(p);
     }
+    return entropy;
+}
 
-    // Build Huffman tree
-    priority_queue<HuffmanNode*, vector<HuffmanNode*>, Compare> pq;
-    for (auto &p : freq) pq.push(new HuffmanNode(p.first, (int)p.second));
-    while (pq.size() > 1) {
-        HuffmanNode *left = pq.top(); pq.pop();
-        HuffmanNode *right = pq.top(); pq.pop();
-        HuffmanNode *node = new HuffmanNode(0, left->freq + right->freq);
-        node->left = left; node->right = right;
-        pq.push(node);
-    }
-    HuffmanNode *root = pq.top();
-    unordered_map<unsigned char, string> huffmanCode;
-    buildCodes(root, "", huffmanCode);
+double sampleEntropy(istream &in, uint64_t size) {
+    const size_t ENTROPY_SAMPLE = 1024 * 1024; // 1 MiB
+    size_t sampleLen = (size_t)min<uint64_t>(ENTROPY_SAMPLE, size);
+    streampos start = in.tellg();
+    if (sampleLen == 0 || start == streampos(-1)) return 0.0; // nothing to sample, or cannot rewind
+
+    vector<uint8_t> sample(sampleLen);
+    in.read(reinterpret_cast<char*>(sample.data()), (std::streamsize)sampleLen);
+    streamsize got = in.gcount();
+    in.clear();
+    in.seekg(start);
+    return got > 0 ? sampleEntropy(sample.data(), (size_t)got) : 0.0;
+}
 
-    // Compute encoded length by scanning tmpLzPath
-    uint64_t encodedLen = 0;
-    {
-        ifstream scan(tmpLzPath, ios::binary);
-        if (!scan.is_open()) { freeTree(root); try { fs::remove(tmpLzPath); } catch(...) {} throw runtime_error("Failed to open temp LZ77 file for scanning."); }
-        const size_t SCAN_BUF = 64 * 1024;
-        vector<uint8_t> scanbuf;
-        scanbuf.reserve(SCAN_BUF);
-        while (true) {
-            scanbuf.clear();
-            scanbuf.resize(SCAN_BUF);
-            scan.read(reinterpret_cast<char*>(scanbuf.data()), (std::streamsize)SCAN_BUF);
-            streamsize got = scan.gcount();
-            if (got <= 0) break;
-            scanbuf.resize((size_t)got);
-            for (uint8_t b : scanbuf) {
-                auto it = huffmanCode.find(static_cast<unsigned char>(b));
-                if (it == huffmanCode.end()) { freeTree(root); scan.close(); try { fs::remove(tmpLzPath); } catch(...) {} throw runtime_error("Huffman code missing for byte (unexpected)."); }
-                encodedLen += it->second.size();
-            }
-            if (got < (streamsize)SCAN_BUF) break;
-        }
-        scan.close();
+// compressStream: KP06 block container; independent blocks are compressed in parallel
+bool compressStream(istream &in, uint64_t size, ostream &out, const string &ext, const CompressOptions &options) {
+    // Empty input is stored raw; otherwise every block picks its own mode
+    if (size == 0) {
+        storeRawStream(in, size, out, ext);
+        return false;
     }
 
-    // Prepare encoded temp and write header + map
-    fs::path tmpEncPath = outPath.string() + ".enc.tmp";
-    try { if (fs::exists(tmpEncPath)) fs::remove(tmpEncPath); } catch(...) {}
+    // Blocks are compressed by the pool and written strictly in input order,
+    // so the output does not depend on the thread count
+    size_t threads = ThreadPool::resolveThreadCount(options.threads);
+    ThreadPool pool(threads);
+    OrderedWriter writer(out, threads * 2);
+    queueBlockStream(writer, pool, in, size, ext, options);
+    writer.drain();
+    return true;
+}
 
-    ofstream encOut(tmpEncPath, ios::binary);
-    if (!encOut.is_open()) { freeTree(root); try { fs::remove(tmpLzPath); } catch(...) {} throw runtime_error("Cannot open temporary encoded output file for writing."); }
+// Same as compressStream, but workers read blocks straight from memory
+static bool compressMemory(shared_ptr<const void> owner, const uint8_t *data, uint64_t size,
+                           ostream &out, const string &ext, const CompressOptions &options) {
+    size_t threads = ThreadPool::resolveThreadCount(options.threads);
+    ThreadPool pool(threads);
+    OrderedWriter writer(out, threads * 2);
+    bool compress = size > 0;
+    if (compress) queueBlockStream(writer, pool, owner, data, size, ext, options);
+    else queueRawStream(writer, owner, data, size, ext);
+    writer.drain();
+    return compress;
+}
 
-    encOut.write(KITTY_MAGIC_V3.c_str(), KITTY_MAGIC_V3.size());
-    bool isCompressed = true;
-    encOut.write(reinterpret_cast<const char*>(&isCompressed), sizeof(isCompressed));
+vector<uint8_t> compressBuffer(const uint8_t *data, size_t size, const CompressOptions &options, const string &ext) {
+    vector<uint8_t> result;
+    VectorOutputBuf outBuf(result);
+    ostream out(&outBuf);
+    compressMemory(nullptr, data, size, out, ext, options);  // drained before returning, so no owner needed
+    return result;
+}
 
-    string ext = filesystem::path(inputPath).extension().string();
-    uint64_t extLen = ext.size();
-    encOut.write(reinterpret_cast<const char*>(&extLen), sizeof(extLen));
-    if (extLen > 0) encOut.write(ext.c_str(), extLen);
-
-    uint64_t mapSize = huffmanCode.size();
-    encOut.write(reinterpret_cast<const char*>(&mapSize), sizeof(mapSize));
-    for (auto &pair : huffmanCode) {
-        unsigned char c = pair.first;
-        const string &code = pair.second;
-        uint64_t len = code.size();
-        encOut.write(reinterpret_cast<const char*>(&c), sizeof(c));
-        encOut.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        encOut.write(code.c_str(), len);
+void compressFile(const string &inputPath, const string &outputPath, const CompressOptions &options) {
+    if (!fs::exists(inputPath)) throw runtime_error("Input not found.");
+    string ext = fs::path(inputPath).extension().string();
+
+    // Prefer a memory map: blocks go to the workers without being copied
+    auto map = make_shared<MappedFile>(inputPath);
+    ifstream in;
+    if (!map->valid()) {
+        in.open(inputPath, ios::binary);
+        if (!in.is_open()) throw runtime_error("Cannot open input file.");
     }
+    uint64_t originalSize = map->valid() ? map->size() : (uint64_t)fs::file_size(inputPath);
 
-    encOut.write(reinterpret_cast<const char*>(&encodedLen), sizeof(encodedLen));
-    encOut.flush();
+    ofstream out(outputPath, ios::binary | ios::trunc);
+    if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
+    bool compressed = map->valid() ? compressMemory(map, map->data(), originalSize, out, ext, options)
+                                   : compressStream(in, originalSize, out, ext, options);
+    out.close();
+    if (!out) throw runtime_error("Failed writing output file.");
 
-    // Read tmpLzPath and write codes
-    {
-        ifstream readLz(tmpLzPath, ios::binary);
-        if (!readLz.is_open()) { freeTree(root); encOut.close(); try { fs::remove(tmpLzPath); } catch(...) {} try { fs::remove(tmpEncPath); } catch(...) {} throw runtime_error("Failed to open temp LZ77 file for second pass."); }
-        BitWriter writer(encOut);
-        const size_t PASS_BUF = 64 * 1024;
-        vector<uint8_t> passbuf;
-        passbuf.reserve(PASS_BUF);
-        while (true) {
-            passbuf.clear();
-            passbuf.resize(PASS_BUF);
-            readLz.read(reinterpret_cast<char*>(passbuf.data()), (std::streamsize)PASS_BUF);
-            streamsize got = readLz.gcount();
-            if (got <= 0) break;
-            passbuf.resize((size_t)got);
-            for (uint8_t b : passbuf) {
-                const string &code = huffmanCode[static_cast<unsigned char>(b)];
-                writer.writeBits(code);
-            }
-            if (got < (streamsize)PASS_BUF) break;
-        }
-        writer.flush();
-        readLz.close();
+    if (!compressed) {
+        cout << "\n⚡ Smart Skip: Empty file — storing raw.\n";
+        return;
     }
 
-    encOut.flush();
-    encOut.close();
-    freeTree(root);
-
     // Compare sizes and keep encoded or fallback to raw
-    size_t encodedSize = 0;
-    try { encodedSize = (size_t)fs::file_size(tmpEncPath); } catch(...) { encodedSize = SIZE_MAX; }
-
+    uint64_t encodedSize = (uint64_t)fs::file_size(outputPath);
     if (encodedSize < originalSize) {
-        try { fs::rename(tmpEncPath, outputPath); } catch(...) {
-            ifstream src(tmpEncPath, ios::binary);
-            ofstream dst(outputPath, ios::binary);
-            dst << src.rdbuf();
-            src.close(); dst.close();
-            try { fs::remove(tmpEncPath); } catch(...) {}
-        }
         cout << "\n🐾 Smart Mode: Compression effective ("
              << fixed << setprecision(2)
              << 100.0 * (1.0 - (double)encodedSize / originalSize)
              << "% saved)\n";
         cout << "Final size: " << encodedSize << " bytes (original " << originalSize << ")\n";
-        try { fs::remove(tmpLzPath); } catch(...) {}
     } else {
-        try { fs::remove(tmpEncPath); } catch(...) {}
-        try { fs::remove(tmpLzPath); } catch(...) {}
         cout << "\n⚡ Smart Mode: Compression skipped (file too compact)\n";
-        storeRawFile(inputPath, outputPath);
+        ofstream raw(outputPath, ios::binary | ios::trunc);
+        if (!raw.is_open()) throw runtime_error("Cannot open output file for writing.");
+        if (map->valid()) {
+            MemoryInputBuf mapBuf(map->data(), (size_t)originalSize);
+            istream mapIn(&mapBuf);
+            storeRawStream(mapIn, originalSize, raw, ext);
+        } else {
+            in.clear();
+            in.seekg(0, ios::beg);
+            storeRawStream(in, originalSize, raw, ext);
+        }
     }
 }
 
-// decompressFile: full implementation (KP01, KP02, KP03)
-void decompressFile(const string &inputPath, const string &outputPath) {
-    ifstream in(inputPath, ios::binary);
-    if (!in.is_open()) throw runtime_error("Cannot open input file.");
+// Long-mode KP06 blocks reference the ones before them, so they are decoded
+// in order into a window that keeps at least the last 1 << windowLog bytes
+static void decodeLongBlocks(istream &in, ostream &out, OutputFile *file, uint64_t fileOffset,
+                             uint64_t originalSize, unsigned windowLog, const DecompressOptions &options) {
+    const size_t windowSize = size_t(1) << windowLog;
+    vector<uint8_t> window;
+    uint64_t total = 0;
+    BlockHeader header;
+    vector<uint8_t> payload;
+    while (total < originalSize) {
+        if (!readBlockHeader(in, header)) throw runtime_error("Truncated KP06 stream.");
+        payload.resize(header.payloadSize);
+        in.read(reinterpret_cast<char*>(payload.data()), payload.size());
+        if ((uint64_t)in.gcount() != header.payloadSize) throw runtime_error("Unexpected EOF in block payload.");
+        if (total + header.rawSize > originalSize) throw runtime_error("Block sizes do not match original size.");
+
+        const size_t base = window.size();
+        decompressBlock(header, payload.data(), window, options.dictionary.get(), min(base, windowSize));
+        if (file) file->writeAt(fileOffset + total, window.data() + base, header.rawSize);
+        else out.write(reinterpret_cast<const char*>(window.data() + base), header.rawSize);
+        if (window.size() > 2 * windowSize) window.erase(window.begin(), window.end() - windowSize);
+        total += header.rawSize;
+    }
+}
+
+// Independent KP06 blocks are read in order and decoded on the pool. With a
+// file target each worker writes its block at its own offset; otherwise
+// blocks are committed to out in order. Neither side needs to seek.
+static void decodeIndependentBlocks(istream &in, ostream &out, OutputFile *file, uint64_t fileOffset,
+                                    uint64_t originalSize, const DecompressOptions &options) {
+    size_t threads = ThreadPool::resolveThreadCount(options.threads);
+    ThreadPool pool(threads);
+    OrderedWriter writer(out, threads * 2);
+    deque<future<void>> placed;   // positional writes still in flight
+
+    uint64_t total = 0;
+    BlockHeader header;
+    while (total < originalSize) {
+        if (!readBlockHeader(in, header)) throw runtime_error("Truncated KP06 stream.");
+        vector<uint8_t> payload(header.payloadSize);
+        in.read(reinterpret_cast<char*>(payload.data()), payload.size());
+        if ((uint64_t)in.gcount() != header.payloadSize) throw runtime_error("Unexpected EOF in block payload.");
+        if (total + header.rawSize > originalSize) throw runtime_error("Block sizes do not match original size.");
+
+        if (file) {
+            if (placed.size() >= threads * 2) { placed.front().get(); placed.pop_front(); }
+            uint64_t at = fileOffset + total;
+            placed.push_back(pool.submit([header, data = move(payload), file, at, dict = options.dictionary]() {
+                vector<uint8_t> decoded;
+                decoded.reserve(header.rawSize);
+                decompressBlock(header, data.data(), decoded, dict.get());
+                file->writeAt(at, decoded.data(), decoded.size());
+            }));
+        } else {
+            shared_future<vector<uint8_t>> job = pool.submit([header, data = move(payload), dict = options.dictionary]() {
+                vector<uint8_t> decoded;
+                decoded.reserve(header.rawSize);
+                decompressBlock(header, data.data(), decoded, dict.get());
+                return decoded;
+            }).share();
+            writer.push([job]() { return job.get(); });
+        }
+        total += header.rawSize;
+    }
+    while (!placed.empty()) { placed.front().get(); placed.pop_front(); }
+    writer.drain();
+}
 
+// Decodes the KP06 blocks that follow the header (windowLog > 0: long mode)
+static void decodeBlockStream(istream &in, ostream &out, OutputFile *file, uint64_t fileOffset,
+                              uint64_t originalSize, unsigned windowLog, const DecompressOptions &options) {
+    if (file) file->resize(fileOffset + originalSize);
+    if (windowLog) decodeLongBlocks(in, out, file, fileOffset, originalSize, windowLog, options);
+    else decodeIndependentBlocks(in, out, file, fileOffset, originalSize, options);
+}
+
+// Full decoder (KP01, KP02, KP03, KP05, KP06). file, when given, is the
+// target behind out (file is its OutputFileBuf), used for positional KP06 writes.
+static string decodeKittyStream(istream &in, ostream &out, OutputFileBuf *file, OutputFile *target,
+                                const DecompressOptions &options) {
     string magic(4, '\0');
     in.read(&magic[0], 4);
     if (!in) throw runtime_error("Failed to read file signature.");
 
     // KP01 (old single-layer Huffman)
     if (magic == KITTY_MAGIC_V1) {
-        uint64_t mapSize;
-        in.read(reinterpret_cast<char*>(&mapSize), sizeof(mapSize));
-        unordered_map<unsigned char, string> huffmanCode;
-        for (uint64_t i = 0; i < mapSize; ++i) {
-            unsigned char c; uint64_t len;
-            in.read(reinterpret_cast<char*>(&c), sizeof(c));
-            in.read(reinterpret_cast<char*>(&len), sizeof(len));
-            string code(len, '\0');
-            in.read(&code[0], len);
-            huffmanCode[c] = code;
-        }
-        uint64_t encodedLen;
-        in.read(reinterpret_cast<char*>(&encodedLen), sizeof(encodedLen));
-        BitReader reader(in);
-        bool bit;
-        string bitstream; bitstream.reserve(encodedLen);
-        while (reader.readBit(bit)) bitstream += (bit ? '1' : '0');
-        in.close();
-        if (bitstream.size() > encodedLen) bitstream.resize(encodedLen);
-        unordered_map<string, unsigned char> reverseCode;
-        for (auto &p : huffmanCode) reverseCode[p.second] = p.first;
-        string current;
-        vector<char> decoded;
-        for (char b : bitstream) {
-            current += b;
-            auto it = reverseCode.find(current);
-            if (it != reverseCode.end()) {
-                decoded.push_back((char)it->second);
-                current.clear();
-            }
-        }
-        ofstream out(outputPath, ios::binary);
-        if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
-        if (!decoded.empty()) out.write(decoded.data(), decoded.size());
-        out.close();
-        cout << "Decompressed (KP01) successfully → " << outputPath << endl;
-        return;
+        decodeHuffmanPayload(in, readCodeMap(in), writeTo(out));
+        return magic;
     }
 
-    // KP02 (store or Huffman-on-bytes)
-    if (magic == KITTY_MAGIC_V2) {
-        bool isCompressed = false;
-        in.read(reinterpret_cast<char*>(&isCompressed), sizeof(isCompressed));
-        uint64_t extLen = 0; in.read(reinterpret_cast<char*>(&extLen), sizeof(extLen));
-        if (extLen > 0) {
-            string ext; ext.resize(extLen);
-            in.read(&ext[0], extLen);
-        }
-        if (!isCompressed) {
-            restoreRawFile(in, outputPath);
-            in.close();
-            cout << "Restored raw file (KP02) → " << outputPath << endl;
-            return;
+    if (magic != KITTY_MAGIC_V2 && magic != KITTY_MAGIC_V3 && magic != KITTY_MAGIC_V5 && magic != KITTY_MAGIC_V6)
+        throw runtime_error("Unknown or corrupted .kitty file (bad signature).");
+
+    // KP02+ share: isCompressed/flags byte, uint64 extLen, ext
+    uint8_t flags = 0;
+    in.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+    uint64_t extLen = 0; in.read(reinterpret_cast<char*>(&extLen), sizeof(extLen));
+    if (!in || extLen > 4096) throw runtime_error("Corrupted .kitty header.");
+    string ext(extLen, '\0');
+    if (extLen > 0) in.read(&ext[0], extLen);
+
+    // KP06 (independent LZ77 + Huffman blocks)
+    if (magic == KITTY_MAGIC_V6) {
+        uint64_t originalSize = 0;
+        uint32_t blockSize = 0;
+        in.read(reinterpret_cast<char*>(&originalSize), sizeof(originalSize));
+        in.read(reinterpret_cast<char*>(&blockSize), sizeof(blockSize));
+        if (!in) throw runtime_error("Corrupted KP06 header.");
+        if (flags & KP06_FLAG_DICTIONARY) {
+            uint32_t dictId = 0;
+            in.read(reinterpret_cast<char*>(&dictId), sizeof(dictId));
+            if (!in) throw runtime_error("Corrupted KP06 header.");
+            if (!options.dictionary || options.dictionary->id != dictId) {
+                ostringstream msg;
+                msg << "This stream was compressed with dictionary " << hex << setw(8) << setfill('0') << dictId
+                    << "; pass it with --dict.";
+                throw runtime_error(msg.str());
+            }
         }
-        uint64_t mapSize;
-        in.read(reinterpret_cast<char*>(&mapSize), sizeof(mapSize));
-        unordered_map<unsigned char, string> huffmanCode;
-        for (uint64_t i = 0; i < mapSize; ++i) {
-            unsigned char c; uint64_t len;
-            in.read(reinterpret_cast<char*>(&c), sizeof(c));
-            in.read(reinterpret_cast<char*>(&len), sizeof(len));
-            string code(len, '\0');
-            in.read(&code[0], len);
-            huffmanCode[c] = code;
+        uint8_t windowLog = 0;
+        if (flags & KP06_FLAG_LONG_WINDOW) {
+            in.read(reinterpret_cast<char*>(&windowLog), sizeof(windowLog));
+            if (!in || windowLog < LDM_MIN_WINDOW_LOG || windowLog > LDM_MAX_WINDOW_LOG)
+                throw runtime_error("Corrupted KP06 header.");
         }
-        uint64_t encodedLen; in.read(reinterpret_cast<char*>(&encodedLen), sizeof(encodedLen));
-        BitReader reader(in);
-        bool bit; string bitstream; bitstream.reserve(encodedLen);
-        while (reader.readBit(bit)) bitstream += (bit ? '1' : '0');
-        in.close();
-        if (bitstream.size() > encodedLen) bitstream.resize(encodedLen);
-        unordered_map<string, unsigned char> reverseCode;
-        for (auto &p : huffmanCode) reverseCode[p.second] = p.first;
-        string current; vector<char> decoded;
-        for (char b : bitstream) {
-            current += b;
-            auto it = reverseCode.find(current);
-            if (it != reverseCode.end()) {
-                decoded.push_back((char)it->second);
-                current.clear();
-            }
+        if (file) {
+            out.flush();
+            decodeBlockStream(in, out, target, file->position(), originalSize, windowLog, options);
+        } else {
+            decodeBlockStream(in, out, nullptr, 0, originalSize, windowLog, options);
         }
-        ofstream out(outputPath, ios::binary);
-        if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
-        if (!decoded.empty()) out.write(decoded.data(), decoded.size());
-        out.close();
-        cout << "Decompressed (KP02) successfully → " << outputPath << endl;
-        return;
+        return magic;
     }
 
-    // KP03 (LZ77 + Huffman)
-    if (magic != KITTY_MAGIC_V3) {
-        throw runtime_error("Unknown or corrupted .kitty file (bad signature).");
+    if (!flags) {   // isCompressed == false
+        restoreRawStream(in, out);
+        return magic + " raw";
     }
 
-    bool isCompressed = false;
-    in.read(reinterpret_cast<char*>(&isCompressed), sizeof(isCompressed));
-    uint64_t extLen = 0; in.read(reinterpret_cast<char*>(&extLen), sizeof(extLen));
-    string ext;
-    if (extLen > 0) {
-        ext.resize(extLen);
-        in.read(&ext[0], extLen);
+    // KP02 (Huffman-on-bytes)
+    if (magic == KITTY_MAGIC_V2) {
+        decodeHuffmanPayload(in, readCodeMap(in), writeTo(out));
+        return magic;
     }
 
-    if (!isCompressed) {
-        restoreRawFile(in, outputPath);
-        in.close();
-        cout << "Restored raw file (KP03) → " << outputPath << endl;
-        return;
-    }
+    // KP05 is only ever written raw; compressed data goes to KP06
+    if (magic == KITTY_MAGIC_V5) throw runtime_error("Unsupported KP05 stream (only raw KP05 is read).");
 
-    // read Huffman map
-    uint64_t mapSize = 0;
-    in.read(reinterpret_cast<char*>(&mapSize), sizeof(mapSize));
-    unordered_map<unsigned char, string> huffmanCode;
-    for (uint64_t i = 0; i < mapSize; ++i) {
-        unsigned char c; uint64_t len;
-        in.read(reinterpret_cast<char*>(&c), sizeof(c));
-        in.read(reinterpret_cast<char*>(&len), sizeof(len));
-        string code(len, '\0');
-        in.read(&code[0], len);
-        huffmanCode[c] = code;
-    }
+    // KP03 (LZ77 + Huffman); Huffman-decoded token bytes stream straight
+    // into the LZ77 decoder
+    LZ77StreamDecoder lz(writeTo(out));
+    decodeHuffmanPayload(in, readCodeMap(in), [&lz](const uint8_t *data, size_t size) { lz.feed(data, size); });
+    lz.finish();
+    return magic;
+}
 
-    uint64_t encodedLen = 0;
-    in.read(reinterpret_cast<char*>(&encodedLen), sizeof(encodedLen));
+string decompressStream(istream &in, ostream &out, const DecompressOptions &options) {
+    return decodeKittyStream(in, out, nullptr, nullptr, options);
+}
 
-    // read Huffman bitstream into string of bits
-    BitReader reader(in);
-    bool bit; string bitstream; bitstream.reserve(encodedLen);
-    while (reader.readBit(bit)) bitstream += (bit ? '1' : '0');
-    in.close();
-    if (bitstream.size() > encodedLen) bitstream.resize(encodedLen);
-
-    // Decode to get serialized LZ77 bytes
-    unordered_map<string, unsigned char> reverseCode;
-    for (auto &p : huffmanCode) reverseCode[p.second] = p.first;
-    string current;
-    vector<uint8_t> tokenBytes;
-    for (char b : bitstream) {
-        current += b;
-        auto it = reverseCode.find(current);
-        if (it != reverseCode.end()) {
-            tokenBytes.push_back(it->second);
-            current.clear();
-        }
+string decompressToFile(istream &in, const string &outputPath, const DecompressOptions &options) {
+    OutputFile file(outputPath);
+    string format;
+    {
+        OutputFileBuf buf(file);
+        ostream out(&buf);
+        format = decodeKittyStream(in, out, &buf, &file, options);
+        out.flush();
+        if (!out) throw runtime_error("Failed writing decompressed output.");
     }
+    file.close();
+    return format;
+}
 
-    // Deserialize tokens and LZ77-decompress
-    auto tokens_out = lz77_deserialize(tokenBytes);
-    auto original = lz77_decompress(tokens_out);
-
-    ofstream out(outputPath, ios::binary);
-    if (!out.is_open()) throw runtime_error("Cannot open output file for writing.");
-    if (!original.empty()) out.write(reinterpret_cast<const char*>(original.data()), original.size());
-    out.close();
+vector<uint8_t> decompressBuffer(const uint8_t *data, size_t size, const DecompressOptions &options) {
+    MemoryInputBuf inBuf(data, size);
+    istream in(&inBuf);
+    vector<uint8_t> result;
+    VectorOutputBuf outBuf(result);
+    ostream out(&outBuf);
+    decompressStream(in, out, options);
+    return result;
+}
 
-    cout << "Decompressed (KP03) successfully → " << outputPath << endl;
+void decompressFile(const string &inputPath, const string &outputPath, const DecompressOptions &options) {
+    ifstream in(inputPath, ios::binary);
+    if (!in.is_open()) throw runtime_error("Cannot open input file.");
+    string format = decompressToFile(in, outputPath, options);
+    cout << "Decompressed (" << format << ") successfully → " << outputPath << endl;
 }
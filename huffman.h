@@ -8,28 +8,141 @@
 #include <bitset>
 #include <memory>
 #include <cstdint>
+#include <stdexcept>
+#include "bitstream.h"
+#include "lz77.h"
 
-// Use unsigned char for full 0-255 byte support
-struct HuffmanNode {
-    unsigned char ch;
-    int freq;
-    HuffmanNode *left;
-    HuffmanNode *right;
+// Longest code the encoder emits; keeps decode tables to two levels and
+// lets every code length fit in one nibble of a packed table.
+const unsigned HUFFMAN_MAX_BITS = 15;
 
-    HuffmanNode(unsigned char c, int f) : ch(c), freq(f), left(nullptr), right(nullptr) {}
+// Length-limited Huffman code lengths for freq (0 = symbol unused)
+std::vector<uint8_t> buildCodeLengths(const std::vector<uint64_t> &freq, unsigned maxBits = HUFFMAN_MAX_BITS);
+
+// Canonical code values (right-aligned, MSB-first) derived from code lengths
+std::vector<uint32_t> canonicalCodes(const std::vector<uint8_t> &lengths);
+
+// Code lengths stored two per byte (high nibble first)
+std::vector<uint8_t> packCodeLengths(const std::vector<uint8_t> &lengths);
+std::vector<uint8_t> unpackCodeLengths(const uint8_t *packed, size_t count);
+
+// Table-driven decoder for MSB-first prefix codes.
+// A primary table indexed by the next TABLE_BITS bits resolves short codes in
+// one lookup; longer codes chain into sub-tables keyed by the following bits.
+class HuffmanDecoder {
+public:
+    static constexpr unsigned TABLE_BITS = 11;
+
+    // Build from legacy (KP01-KP03) code strings of '0'/'1'
+    void buildFromCodes(const std::unordered_map<unsigned char, std::string> &codes);
+    // Build from canonical code lengths (KP06 blocks)
+    void buildFromLengths(const std::vector<uint8_t> &lengths);
+
+    inline uint32_t decode(BitReader &reader) const {
+        reader.refill();
+        const Entry *t = table.data();
+        unsigned width = rootBits;
+        Entry e = t[reader.peekBits(width)];
+        while (e.kind == SUBTABLE) {
+            reader.skipBits(width);
+            reader.refill();
+            t = table.data() + e.value;
+            width = e.len;
+            e = t[reader.peekBits(width)];
+        }
+        if (e.kind != SYMBOL) throw std::runtime_error("Invalid Huffman code in bitstream.");
+        reader.skipBits(e.len);
+        return e.value;
+    }
+
+private:
+    enum : uint8_t { INVALID = 0, SYMBOL = 1, SUBTABLE = 2 };
+    struct Entry {
+        uint32_t value; // symbol, or offset of sub-table
+        uint8_t len;    // bits consumed by symbol, or sub-table width
+        uint8_t kind;
+    };
+    struct Code {
+        uint32_t symbol;
+        uint64_t bits;  // right-aligned, first bit is the most significant
+        unsigned len;
+    };
+
+    std::vector<Entry> table;
+    unsigned rootBits = 1;
+
+    void build(const std::vector<Code> &codes);
+    uint32_t buildLevel(const std::vector<Code> &codes, unsigned consumed, unsigned &width);
 };
 
-// Comparator for priority queue
-struct Compare {
-    bool operator()(HuffmanNode* l, HuffmanNode* r) {
-        return l->freq > r->freq;
+// A canonical code ready for both directions (encoder values and decoder)
+struct HuffmanTable {
+    std::vector<uint8_t> lengths;
+    std::vector<uint32_t> values;
+    HuffmanDecoder decoder;
+
+    void build(const std::vector<uint8_t> &codeLengths) {
+        lengths = codeLengths;
+        values = canonicalCodes(lengths);
+        decoder.buildFromLengths(lengths);
     }
 };
 
-// Main API (KP03 aware)
-void compressFile(const std::string &inputPath, const std::string &outputPath); // writes KP03 with LZ77+Huffman (or KP02 raw/Huffman)
-void decompressFile(const std::string &inputPath, const std::string &outputPath); // handles KP01, KP02, KP03
+struct Dictionary;   // dictionary.h
+
+// CompressOptions::level for the fast ingest mode: no LZ77 pass, every
+// block is RLE, Huffman-only or stored
+const int COMPRESS_LEVEL_FAST = 0;
+
+// Options for the compression side of the main API
+struct CompressOptions {
+    int level = LZ77_DEFAULT_LEVEL;  // 1..9, LZ77_LEVEL_ULTRA or COMPRESS_LEVEL_FAST
+    int threads = 0;                 // worker threads for block compression (0 = all cores)
+    size_t blockSize = 1 << 20;      // raw bytes per independent block (1-8 MiB)
+    bool dedup = false;              // archives: store content-defined chunks once across entries
+    bool solid = false;              // archives: entries share one block stream, grouped by extension
+    std::shared_ptr<const Dictionary> dictionary;  // trained dictionary priming every block
+    unsigned longWindowLog = 0;      // long distance matching over 1 << log bytes (0 = off, 20-27)
+};
+
+// Options for the decompression side of the main API
+struct DecompressOptions {
+    int threads = 0;                 // worker threads for block decoding (0 = all cores)
+    std::shared_ptr<const Dictionary> dictionary;  // needed for streams compressed with one
+};
+
+// Stream/buffer API; the file and archive layers are built on these.
+// compressStream reads size bytes from in and writes one .kitty stream
+// (ext is recorded in its header); returns false if it was stored raw.
+bool compressStream(std::istream &in, uint64_t size, std::ostream &out, const std::string &ext = "",
+                    const CompressOptions &options = CompressOptions());
+std::vector<uint8_t> compressBuffer(const uint8_t *data, size_t size,
+                                    const CompressOptions &options = CompressOptions(), const std::string &ext = "");
+
+// Decodes one .kitty stream from in, leaving in positioned after a KP05/KP06
+// stream; returns the format name (e.g. "KP06", "KP05 raw")
+std::string decompressStream(std::istream &in, std::ostream &out,
+                             const DecompressOptions &options = DecompressOptions());
+// Same, writing to a file: KP06 blocks are written in place by the workers
+std::string decompressToFile(std::istream &in, const std::string &outputPath,
+                             const DecompressOptions &options = DecompressOptions());
+std::vector<uint8_t> decompressBuffer(const uint8_t *data, size_t size,
+                                      const DecompressOptions &options = DecompressOptions());
+
+// File API
+void compressFile(const std::string &inputPath, const std::string &outputPath,
+                  const CompressOptions &options = CompressOptions()); // writes KP06 blocks of LZ77+canonical Huffman (or KP05 raw)
+void decompressFile(const std::string &inputPath, const std::string &outputPath,
+                    const DecompressOptions &options = DecompressOptions()); // handles KP01, KP02, KP03, KP05, KP06
+
+// Order-0 entropy (bits/byte) of the first MiB; the stream variant rewinds in.
+// Compression decides per block (see compressBlock); this only keeps files
+// that look incompressible out of solid archive streams.
+double sampleEntropy(std::istream &in, uint64_t size);
+double sampleEntropy(const uint8_t *data, size_t size);
+const double ENTROPY_SKIP_THRESHOLD = 7.7; // bits/byte above which a file stays out of a solid stream
 
-// Helpers for storing raw files inside .kitty (KP02/KP03 with isCompressed = false)
+// Helpers for storing raw data inside .kitty (KP05 with isCompressed = false)
+void storeRawStream(std::istream &in, uint64_t size, std::ostream &out, const std::string &ext);
+void restoreRawStream(std::istream &in, std::ostream &out); // in is positioned at the raw size field
 void storeRawFile(const std::string &inputPath, const std::string &outputPath);
-void restoreRawFile(std::ifstream &inStream, const std::string &outputPath);
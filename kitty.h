@@ -6,3 +6,5 @@ const std::string KITTY_MAGIC_V1 = "KP01";
 const std::string KITTY_MAGIC_V2 = "KP02";
 const std::string KITTY_MAGIC_V3 = "KP03"; 
 const std::string KITTY_MAGIC_V4 = "KP04";
+const std::string KITTY_MAGIC_V5 = "KP05"; // stored data only (isCompressed = false)
+const std::string KITTY_MAGIC_V6 = "KP06"; // independent blocks, each with its own Huffman table
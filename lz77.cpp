@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <cmath>
+#include <stdexcept>
 
 // (serialize/deserialize/decompress)
 
@@ -17,7 +19,7 @@ std::vector<uint8_t> lz77_serialize(const std::vector<LZ77Token> &tokens) {
             out.push_back(0x01);
             out.push_back(static_cast<uint8_t>(t.offset & 0xFF));
             out.push_back(static_cast<uint8_t>((t.offset >> 8) & 0xFF));
-            out.push_back(t.length);
+            out.push_back(static_cast<uint8_t>(t.length));
         }
     }
     return out;
@@ -64,6 +66,90 @@ std::vector<uint8_t> lz77_decompress(const std::vector<LZ77Token> &tokens) {
     return out;
 }
 
+LZ77StreamDecoder::LZ77StreamDecoder(Sink out, size_t window, size_t chunk)
+    : sink(std::move(out)), windowSize(window), chunkSize(chunk), fill(0), emitted(0),
+      partialLen(0), stopped(false), total(0) {
+    // a flush happens as soon as chunkSize bytes are pending, and one token adds at most 255
+    history.resize(windowSize + chunkSize + 256 + LZ77_COPY_SLACK);
+}
+
+// Decodes one token from p[0..n); returns the bytes it used, or 0 if the
+// token is incomplete
+size_t LZ77StreamDecoder::decodeToken(const uint8_t *p, size_t n) {
+    if (p[0] == 0x00) {
+        if (n < 2) return 0;
+        history[fill++] = p[1];
+        return 2;
+    }
+    if (p[0] == 0x01) {
+        if (n < 4) return 0;
+        size_t offset = (size_t)p[1] | ((size_t)p[2] << 8);
+        size_t length = p[3];
+        if (offset == 0 || offset > fill) throw std::runtime_error("Corrupted LZ77 stream (bad match offset).");
+        lz77_copy_match(history.data() + fill, offset, length);
+        fill += length;
+        return 4;
+    }
+    stopped = true;
+    return n;
+}
+
+void LZ77StreamDecoder::flushChunk() {
+    if (fill > emitted) {
+        sink(history.data() + emitted, fill - emitted);
+        total += fill - emitted;
+    }
+    // keep only the window the next matches may reach
+    if (fill > windowSize) {
+        memmove(history.data(), history.data() + fill - windowSize, windowSize);
+        fill = windowSize;
+    }
+    emitted = fill;
+}
+
+void LZ77StreamDecoder::feed(const uint8_t *bytes, size_t n) {
+    size_t i = 0;
+    // finish a token split across calls
+    while (partialLen > 0 && i < n && !stopped) {
+        partial[partialLen++] = bytes[i++];
+        size_t used = decodeToken(partial, partialLen);
+        if (used > 0) partialLen = 0;
+    }
+    while (i < n && !stopped) {
+        size_t used = decodeToken(bytes + i, n - i);
+        if (used == 0) {
+            partialLen = n - i;
+            memcpy(partial, bytes + i, partialLen);
+            break;
+        }
+        i += used;
+        if (fill - emitted >= chunkSize) flushChunk();
+    }
+}
+
+void LZ77StreamDecoder::finish() {
+    flushChunk();
+}
+
+LZ77Params lz77_level_params(int level) {
+    //                            chain  nice  lazy   optimal
+    static const LZ77Params table[] = {
+        {    4,  16, false, false },  // 1
+        {    8,  32, false, false },  // 2
+        {   16,  64, false, false },  // 3
+        {   16,  32, true,  false },  // 4
+        {   32,  64, true,  false },  // 5
+        {   64, 128, true,  false },  // 6
+        {  128, 255, true,  false },  // 7
+        {  512, 255, true,  false },  // 8
+        {  256, 128, false, true  },  // 9
+        { 4096, 255, false, true  },  // ULTRA
+    };
+    if (level < LZ77_MIN_LEVEL) level = LZ77_MIN_LEVEL;
+    if (level > LZ77_LEVEL_ULTRA) level = LZ77_LEVEL_ULTRA;
+    return table[level - 1];
+}
+
 // simple non-stream LZ77 compressor (kept for compatibility) 
 // naive implementation kept for API completeness (may be slower)
 std::vector<LZ77Token> lz77_compress(const std::vector<uint8_t> &data, size_t windowSize, size_t maxMatch) {
@@ -105,121 +191,278 @@ std::vector<LZ77Token> lz77_compress(const std::vector<uint8_t> &data, size_t wi
 
 // Streaming compressor class implementation 
 
-inline uint32_t LZ77StreamCompressor::make_key(const uint8_t* p) {
-    // pack 3 bytes into 24-bit key; safeguard if not enough bytes (caller ensures KEY_LEN usage)
-    return (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | uint32_t(p[2]);
+// Length of the common prefix of a and b, up to limit (a may overlap b)
+static inline size_t matchLength(const uint8_t* a, const uint8_t* b, size_t limit) {
+    size_t k = 0;
+    while (k + 8 <= limit) {
+        uint64_t x, y;
+        std::memcpy(&x, a + k, 8);
+        std::memcpy(&y, b + k, 8);
+        if (x != y) break;
+        k += 8;
+    }
+    while (k < limit && a[k] == b[k]) ++k;
+    return k;
+}
+
+inline uint32_t LZ77StreamCompressor::hash3(const uint8_t* p) {
+    // pack 3 bytes into a 24-bit key, then spread it over HASH_BITS (caller ensures 3 bytes exist)
+    uint32_t key = (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | uint32_t(p[2]);
+    return (key * 2654435761u) >> (32 - HASH_BITS);
 }
 
-LZ77StreamCompressor::LZ77StreamCompressor(size_t w, size_t m)
-    : windowSize(w), maxMatch(m), absolutePos(0) {
-    dict.reserve(65536);
+inline void LZ77StreamCompressor::insertPosition(uint64_t pos) {
+    uint32_t h = hash3(&buffer[(size_t)(pos - bufferStart)]);
+    prev[pos & chainMask] = head[h];
+    head[h] = uint32_t(pos);
+}
+
+LZ77StreamCompressor::LZ77StreamCompressor(size_t w, size_t m, int level)
+    : windowSize(w), maxMatch(m), params(lz77_level_params(level)),
+      bufferStart(0), cursor(0), inserted(0) {
+    size_t chainSize = 1;
+    while (chainSize < windowSize) chainSize <<= 1;
+    chainMask = chainSize - 1;
+    head.assign(size_t(1) << HASH_BITS, 0);
+    prev.assign(chainSize, 0);
+    buffer.reserve(2 * windowSize + 64 * 1024 + maxMatch);
+    if (params.optimal) {
+        litLenCount.assign(LZ_LONG_LITLEN_SYMBOLS, 1);
+        distCount.assign(LZ_LONG_DIST_SYMBOLS, 1);
+        litLenPrice.assign(LZ_LONG_LITLEN_SYMBOLS, 0);
+        distPrice.assign(LZ_LONG_DIST_SYMBOLS, 0);
+    }
+}
+
+void LZ77StreamCompressor::prime(const uint8_t* data, size_t size) {
+    if (size > windowSize) { data += size - windowSize; size = windowSize; }
+    buffer.insert(buffer.end(), data, data + size);
+    cursor = size;   // hashed by the first parse, which inserts everything below the cursor
 }
 
 void LZ77StreamCompressor::feed(const std::vector<uint8_t>& chunk, bool isLast) {
-    processChunk(chunk, isLast);
+    processChunk(chunk.data(), chunk.size(), isLast);
 }
 
-void LZ77StreamCompressor::processChunk(const std::vector<uint8_t>& chunk, bool /*isLast*/) {
-    const size_t n = chunk.size();
-    if (n == 0) return;
+void LZ77StreamCompressor::feed(const uint8_t* data, size_t size, bool isLast) {
+    processChunk(data, size, isLast);
+}
 
-    const size_t MIN_MATCH = 3;
+// Adds every position below pos that has a full key to the hash chains
+void LZ77StreamCompressor::insertUpTo(uint64_t pos, uint64_t end) {
     const size_t KEY_LEN = 3;
-    const size_t MAX_POS_PER_KEY = 64;
+    for (; inserted < pos; ++inserted)
+        if (inserted + KEY_LEN <= end) insertPosition(inserted);
+}
 
-    size_t i = 0;
-    while (i < n) {
-        size_t bestLen = 0;
-        size_t bestOffset = 0;
+// Longest match for pos within the window; optionally records every
+// improvement along the chain (increasing lengths, nearest distance first)
+size_t LZ77StreamCompressor::longestMatch(uint64_t pos, uint64_t end, size_t &bestDist, std::vector<Candidate> *all) {
+    const size_t KEY_LEN = 3;
+    const size_t MIN_MATCH = 3;
+    const size_t avail = (size_t)(end - pos);
+    size_t bestLen = 0;
+    bestDist = 0;
+    if (avail < KEY_LEN) return 0;
 
-        if (i + KEY_LEN <= n && window.size() + (n - i) >= KEY_LEN) {
-            // Build a temporary accessible buffer view that combines window tail and remaining chunk
-            // For candidate matching we use positions stored relative to absolutePos.
-            uint32_t key = make_key(&chunk[i]);
-            auto it = dict.find(key);
-            if (it != dict.end()) {
-                auto& dq = it->second;
-                size_t tries = 0;
-                const size_t MAX_TRIES = 32;
-                for (auto rit = dq.rbegin(); rit != dq.rend() && tries < MAX_TRIES; ++rit, ++tries) {
-                    size_t j = *rit; // absolute position of candidate
-                    size_t offset = absolutePos + i - j;
-                    if (offset == 0 || offset > windowSize) continue;
-
-                    // Compare bytes: we need to read from the window / chunk combined
-                    size_t k = 0;
-                    size_t limit = std::min(maxMatch, n - i);
-                    while (k < limit) {
-                        size_t posCandidate = j + k;
-                        size_t posCurrent = absolutePos + i + k;
-                        uint8_t candidateByte;
-                        if (posCandidate < absolutePos) { // in older window (should not happen because we evict old positions)
-                            break;
-                        } else if (posCandidate < absolutePos + window.size()) {
-                            candidateByte = window[posCandidate - absolutePos];
-                        } else {
-                            // candidate lies in already processed chunk area — safe to break early
-                            break;
-                        }
-
-                        // current byte from chunk
-                        uint8_t currentByte = chunk[i + k];
-                        if (candidateByte != currentByte) break;
-                        ++k;
-                    }
+    const uint8_t* cur = buffer.data() + (pos - bufferStart);
+    const size_t maxDist = (size_t)std::min<uint64_t>(windowSize, pos - bufferStart);
+    const size_t limit = std::min(maxMatch, avail);
+    const size_t nice = std::min(params.niceLength, limit);
 
-                    if (k > bestLen) {
-                        bestLen = k;
-                        bestOffset = offset;
-                        if (bestLen == maxMatch) break;
-                    }
-                }
+    // Walk the chain from the newest candidate; distances only grow along it
+    uint32_t cand = head[hash3(cur)];
+    size_t lastDist = 0;
+    for (size_t tries = 0; tries < params.maxChain; ++tries) {
+        size_t dist = uint32_t(uint32_t(pos) - cand);
+        if (dist <= lastDist || dist > maxDist) break;
+        lastDist = dist;
+
+        const uint8_t* src = cur - dist;
+        if (src[bestLen] == cur[bestLen]) {
+            size_t k = matchLength(src, cur, limit);
+            if (k > bestLen) {
+                bestLen = k;
+                bestDist = dist;
+                if (all && k >= MIN_MATCH) all->push_back(Candidate{ k, dist });
+                if (bestLen >= nice) break;
             }
         }
+        cand = prev[cand & chainMask];
+    }
+    return bestLen;
+}
 
-        if (bestLen >= MIN_MATCH) {
-            if (bestOffset > 0xFFFF) bestOffset = 0xFFFF;
-            if (bestLen > 0xFF) bestLen = 0xFF;
-            LZ77Token t{ static_cast<uint16_t>(bestOffset), static_cast<uint8_t>(bestLen), 0 };
-            pendingTokens.push_back(t);
-
-            // register matched positions
-            size_t end = i + bestLen;
-            for (size_t p = i; p < end; ++p) {
-                if (absolutePos + p >= absolutePos) {
-                    // register key at position absolutePos + p if possible
-                    if (p + KEY_LEN <= n) {
-                        uint32_t k = make_key(&chunk[p]);
-                        auto &dq = dict[k];
-                        dq.push_back(absolutePos + p);
-                        if (dq.size() > MAX_POS_PER_KEY) dq.pop_front();
+void LZ77StreamCompressor::emitLiteral(uint8_t lit) {
+    pendingTokens.push_back(LZ77Token{ 0, 0, lit });
+    if (params.optimal) litLenCount[lit]++;
+}
+
+void LZ77StreamCompressor::emitMatch(size_t len, size_t dist) {
+    pendingTokens.push_back(LZ77Token{ static_cast<uint32_t>(dist), static_cast<uint32_t>(len), 0 });
+    if (params.optimal) {
+        litLenCount[256 + lz_length_code(len)]++;
+        distCount[lz_dist_code(dist)]++;
+    }
+}
+
+// Prices approximate the Huffman cost of each code (plus its extra bits)
+// from the statistics of what has been emitted so far
+static void refreshTable(std::vector<uint32_t> &count, std::vector<uint32_t> &price) {
+    uint64_t total = 0;
+    for (uint32_t c : count) total += c;
+    if (total > (1u << 20)) {
+        // decay so the model follows the data
+        total = 0;
+        for (auto &c : count) { c = (c >> 1) + 1; total += c; }
+    }
+    for (size_t s = 0; s < count.size(); ++s)
+        price[s] = (uint32_t)std::lround(16.0 * std::log2((double)total / count[s]));
+}
+
+void LZ77StreamCompressor::refreshPrices() {
+    refreshTable(litLenCount, litLenPrice);
+    refreshTable(distCount, distPrice);
+}
+
+inline uint32_t LZ77StreamCompressor::literalPrice(uint8_t lit) const {
+    return litLenPrice[lit];
+}
+
+inline uint32_t LZ77StreamCompressor::matchPrice(size_t len, size_t dist) const {
+    unsigned lc = lz_length_code(len), dc = lz_dist_code(dist);
+    return litLenPrice[256 + lc] + distPrice[dc] + 16 * (lz_length_extra(lc) + lz_dist_extra(dc));
+}
+
+void LZ77StreamCompressor::processChunk(const uint8_t* data, size_t size, bool isLast) {
+    buffer.insert(buffer.end(), data, data + size);
+
+    const uint64_t end = bufferStart + buffer.size();
+    // keep maxMatch bytes of lookahead so matches can run across the seam
+    const uint64_t stop = isLast ? end : (end > cursor + maxMatch ? end - maxMatch : cursor);
+
+    if (params.optimal) parseOptimal(stop, end);
+    else parseGreedy(stop, end);
+    insertUpTo(cursor, end);
+
+    // slide: keep only windowSize bytes of history once twice that has built up
+    size_t history = (size_t)(cursor - bufferStart);
+    if (history > 2 * windowSize) {
+        size_t drop = history - windowSize;
+        buffer.erase(buffer.begin(), buffer.begin() + drop);
+        bufferStart += drop;
+    }
+}
+
+// Greedy parse, with one-step lazy evaluation when params.lazy is set
+void LZ77StreamCompressor::parseGreedy(uint64_t stop, uint64_t end) {
+    const size_t MIN_MATCH = 3;
+    uint64_t nextPos = UINT64_MAX;   // match already searched at cursor + 1
+    size_t nextLen = 0, nextDist = 0;
+
+    while (cursor < stop) {
+        const uint64_t pos = cursor;
+        size_t dist = 0, len = 0;
+        if (pos == nextPos) {
+            len = nextLen; dist = nextDist;
+        } else {
+            insertUpTo(pos, end);
+            len = longestMatch(pos, end, dist);
+        }
+
+        if (params.lazy && len >= MIN_MATCH && len < params.niceLength && pos + 1 < stop) {
+            insertUpTo(pos + 1, end);
+            nextPos = pos + 1;
+            nextLen = longestMatch(nextPos, end, nextDist);
+            if (nextLen > len) {
+                emitLiteral(buffer[(size_t)(pos - bufferStart)]);
+                ++cursor;
+                continue;
+            }
+        }
+
+        if (len >= MIN_MATCH) {
+            emitMatch(len, dist);
+            cursor += len;
+        } else {
+            emitLiteral(buffer[(size_t)(pos - bufferStart)]);
+            ++cursor;
+        }
+    }
+}
+
+// Optimal parse: over each block of positions, collect every useful match,
+// then choose the cheapest token sequence by dynamic programming
+void LZ77StreamCompressor::parseOptimal(uint64_t stop, uint64_t end) {
+    const size_t MIN_MATCH = 3;
+    std::vector<uint32_t> cost;
+    std::vector<uint16_t> stepLen;
+    std::vector<uint32_t> stepDist;
+    std::vector<Candidate> cands;
+    std::vector<std::pair<size_t, size_t>> path;
+
+    while (cursor < stop) {
+        const size_t n = (size_t)std::min<uint64_t>(stop - cursor, OPTIMAL_BLOCK);
+        refreshPrices();
+        cost.assign(n + 1, UINT32_MAX);
+        stepLen.assign(n + 1, 0);
+        stepDist.assign(n + 1, 0);
+        cost[0] = 0;
+
+        const uint8_t* block = buffer.data() + (cursor - bufferStart);
+        size_t skipUntil = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (i < skipUntil) continue;
+            const uint64_t pos = cursor + i;
+            insertUpTo(pos, end);
+            cands.clear();
+            size_t dist = 0;
+            size_t best = longestMatch(pos, end, dist, &cands);
+
+            // a match of at least niceLength is taken as is; the positions it
+            // covers are not searched (their hashes are still inserted)
+            if (best >= params.niceLength) {
+                size_t len = std::min(best, n - i);
+                if (len >= MIN_MATCH) {
+                    uint32_t mc = cost[i] + matchPrice(len, dist);
+                    if (mc < cost[i + len]) {
+                        cost[i + len] = mc;
+                        stepLen[i + len] = (uint16_t)len;
+                        stepDist[i + len] = (uint32_t)dist;
                     }
+                    skipUntil = i + len;
+                    continue;
                 }
             }
-            i += bestLen;
-        } else {
-            // literal
-            LZ77Token t{ 0, 0, chunk[i] };
-            pendingTokens.push_back(t);
-
-            if (i + KEY_LEN <= n) {
-                uint32_t k = make_key(&chunk[i]);
-                auto &dq = dict[k];
-                dq.push_back(absolutePos + i);
-                if (dq.size() > MAX_POS_PER_KEY) dq.pop_front();
+
+            uint32_t c = cost[i] + literalPrice(block[i]);
+            if (c < cost[i + 1]) { cost[i + 1] = c; stepLen[i + 1] = 1; stepDist[i + 1] = 0; }
+
+            size_t from = MIN_MATCH;
+            for (auto &cand : cands) {
+                size_t to = std::min(cand.len, n - i);
+                for (size_t len = from; len <= to; ++len) {
+                    uint32_t mc = cost[i] + matchPrice(len, cand.dist);
+                    if (mc < cost[i + len]) {
+                        cost[i + len] = mc;
+                        stepLen[i + len] = (uint16_t)len;
+                        stepDist[i + len] = (uint32_t)cand.dist;
+                    }
+                }
+                from = std::max(from, cand.len + 1);
             }
-            ++i;
         }
-    }
 
-    // append chunk to sliding window
-    for (uint8_t b : chunk) window.push_back(b);
-    while (window.size() > windowSize) {
-        // remove positions that move out of window: optional pruning of dict entries
-        window.pop_front();
+        path.clear();
+        for (size_t at = n; at > 0; at -= stepLen[at]) path.push_back({ stepLen[at], stepDist[at] });
+        size_t i = 0;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            if (it->second == 0) emitLiteral(block[i]);
+            else emitMatch(it->first, it->second);
+            i += it->first;
+        }
+        cursor += n;
     }
-
-    absolutePos += n;
 }
 
 std::vector<uint8_t> LZ77StreamCompressor::consumeOutput() {
@@ -227,3 +470,102 @@ std::vector<uint8_t> LZ77StreamCompressor::consumeOutput() {
     pendingTokens.clear();
     return out;
 }
+
+void LZ77StreamCompressor::feedMatch(const uint8_t* data, size_t len, size_t dist) {
+    processChunk(data, 0, true);   // parse the held-back lookahead
+    emitMatch(len, dist);
+    buffer.insert(buffer.end(), data, data + len);
+    cursor += len;
+    if (len > windowSize) inserted = cursor - windowSize;   // older positions would slide out anyway
+    processChunk(data, 0, false);  // hash the new history and slide the window
+}
+
+std::vector<LZ77Token> LZ77StreamCompressor::consumeTokens() {
+    std::vector<LZ77Token> out;
+    out.swap(pendingTokens);
+    return out;
+}
+
+// LongMatchFinder
+
+namespace {
+const unsigned LDM_SAMPLE_BITS = 4;   // one position in 16 is indexed
+
+struct LdmGear {
+    uint64_t t[256];
+    LdmGear() {
+        uint64_t x = 0x4C444D5345454431ull;
+        for (auto &v : t) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ull);   // splitmix64
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            v = z ^ (z >> 31);
+        }
+    }
+};
+const LdmGear ldmGear;
+}
+
+LongMatchFinder::LongMatchFinder(const uint8_t* d, uint64_t n, unsigned windowLog)
+    : data(d), size(n), window(uint64_t(1) << windowLog), scanned(0), hash(0), carry{ 0, 0, 0 } {
+    // bit 63 of the gear hash depends on exactly the last 64 bytes
+    static_assert(LDM_MIN_MATCH == 64, "the rolling hash spans 64 bytes");
+    // about one slot per sampled position, for the window or the whole input if smaller
+    unsigned sizeLog = lz_log2((uint32_t)std::min<uint64_t>(std::max<uint64_t>(n, 1), window));
+    tableBits = std::min(22u, std::max(12u, sizeLog + 1 - LDM_SAMPLE_BITS));
+    table.assign(size_t(1) << tableBits, 0);
+}
+
+void LongMatchFinder::seek(uint64_t pos) {
+    hash = 0;
+    for (uint64_t p = pos >= LDM_MIN_MATCH ? pos - LDM_MIN_MATCH : 0; p < pos; ++p)
+        hash = (hash << 1) + ldmGear.t[data[p - base]];
+    scanned = pos;
+}
+
+std::vector<LongMatch> LongMatchFinder::findMatches(uint64_t from, uint64_t to) {
+    std::vector<LongMatch> found;
+    uint64_t lastEnd = from;   // a match may not reach back before this
+    if (carry.length > 0) {
+        uint64_t len = std::min(carry.length, to - from);
+        found.push_back(LongMatch{ from, len, carry.dist });
+        carry.pos += len;
+        carry.length -= len;
+        if (carry.length > 0) return found;
+        lastEnd = from + len;
+    }
+    if (scanned != lastEnd) seek(lastEnd);
+
+    const uint64_t tableMask = table.size() - 1;
+    while (scanned < to) {
+        hash = (hash << 1) + ldmGear.t[data[scanned++ - base]];
+        const uint64_t p = scanned;   // the hash covers [p - 64, p)
+        if (p < LDM_MIN_MATCH || (hash >> (64 - LDM_SAMPLE_BITS)) != 0) continue;
+
+        uint64_t& slot = table[(hash >> (64 - LDM_SAMPLE_BITS - tableBits)) & tableMask];
+        uint64_t cand = slot;
+        slot = p + 1;
+        if (cand == 0) continue;
+        const uint64_t dist = p - (cand - 1);
+        if (dist > window) continue;
+
+        // verify and extend both ways from the hashed span
+        uint64_t start = std::max(p - LDM_MIN_MATCH, lastEnd);
+        const uint8_t* cur = data + (start - base);
+        uint64_t end = start + matchLength(cur - dist, cur, (size_t)(size - start));
+        if (end < p) continue;   // hash collision
+        while (start > lastEnd && start > dist && data[start - 1 - base] == data[start - 1 - dist - base]) --start;
+        if (end - start < LDM_MIN_MATCH) continue;
+
+        uint64_t len = std::min(end, to) - start;
+        found.push_back(LongMatch{ start, len, dist });
+        lastEnd = start + len;
+        if (end > to) {
+            carry = LongMatch{ to, end - to, dist };
+            scanned = to;
+            break;
+        }
+        seek(end);   // positions inside the match are not indexed
+    }
+    return found;
+}
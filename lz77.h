@@ -1,17 +1,34 @@
 // lz77.h 
 #pragma once
 #include <vector>
-#include <deque>
 #include <cstdint>
-#include <unordered_map>
+#include <cstring>
+#include <functional>
 #include <ostream>
 
+// A literal (length 0) or a match. The byte-serialized format only holds
+// offsets up to 65535 and lengths up to 255; KP06 split blocks hold any.
 struct LZ77Token {
-    uint16_t offset;
-    uint8_t length;
+    uint32_t offset;
+    uint32_t length;
     uint8_t lit;
 };
 
+// Compression levels: 1 (fastest) .. 9 (best), plus ULTRA
+const int LZ77_MIN_LEVEL = 1;
+const int LZ77_MAX_LEVEL = 9;
+const int LZ77_LEVEL_ULTRA = 10;
+const int LZ77_DEFAULT_LEVEL = 6;
+
+// Match finder tuning for one level
+struct LZ77Params {
+    size_t maxChain;    // hash-chain candidates examined per position
+    size_t niceLength;  // stop searching once a match this long is found
+    bool lazy;          // one-step lazy matching: defer a match if the next byte starts a longer one
+    bool optimal;       // price-based optimal parse over blocks of positions
+};
+LZ77Params lz77_level_params(int level);
+
 std::vector<LZ77Token> lz77_compress(const std::vector<uint8_t>& data,
                                      size_t windowSize = 65535,
                                      size_t maxMatch = 255);
@@ -19,25 +36,214 @@ std::vector<uint8_t> lz77_serialize(const std::vector<LZ77Token>& tokens);
 std::vector<LZ77Token> lz77_deserialize(const std::vector<uint8_t>& bytes);
 std::vector<uint8_t> lz77_decompress(const std::vector<LZ77Token>& tokens);
 
+// Deflate-style token alphabets (KP06 split blocks): one table codes literals
+// and match lengths, another match distances. A code covers a range of values
+// starting at its base; the offset into the range follows as extra bits.
+// The short alphabets fit ordinary blocks; the long ones (same codes,
+// continued) cover any match inside an 8 MiB block and 128 MiB windows.
+const size_t LZ_MIN_MATCH = 3;
+const unsigned LZ_LENGTH_CODES = 28;                        // lengths 3..258
+const unsigned LZ_LITLEN_SYMBOLS = 256 + LZ_LENGTH_CODES;   // literals, then length codes
+const unsigned LZ_DIST_SYMBOLS = 32;                        // distances 1..65536
+const unsigned LZ_LONG_LENGTH_CODES = 88;                          // lengths 3..8 MiB + 2
+const size_t LZ_LONG_MAX_MATCH = (8 << 20) + 2;
+const unsigned LZ_LONG_LITLEN_SYMBOLS = 256 + LZ_LONG_LENGTH_CODES;
+const unsigned LZ_LONG_DIST_SYMBOLS = 54;                          // distances 1..128 MiB
+
+inline unsigned lz_log2(uint32_t v) {   // v > 0
+#if defined(__GNUC__)
+    return 31u - (unsigned)__builtin_clz(v);
+#else
+    unsigned n = 0;
+    while (v >>= 1) ++n;
+    return n;
+#endif
+}
+
+// Lengths: 8 single-value codes, then groups of 4 codes per extra bit
+inline unsigned lz_length_code(size_t len) {
+    uint32_t v = uint32_t(len - LZ_MIN_MATCH);
+    if (v < 8) return v;
+    unsigned e = lz_log2(v) - 2;
+    return 4 * e + 4 + ((v >> e) & 3);
+}
+inline unsigned lz_length_extra(unsigned code) { return code < 8 ? 0 : (code - 4) / 4; }
+inline size_t lz_length_base(unsigned code) {
+    return LZ_MIN_MATCH + (code < 8 ? code : size_t(4 + (code & 3)) << ((code - 4) / 4));
+}
+
+// Distances: 4 single-value codes, then two codes per power of two
+inline unsigned lz_dist_code(size_t dist) {
+    uint32_t d = uint32_t(dist - 1);
+    if (d < 4) return d;
+    unsigned m = lz_log2(d);
+    return 2 * m + ((d >> (m - 1)) & 1);
+}
+inline unsigned lz_dist_extra(unsigned code) { return code < 4 ? 0 : code / 2 - 1; }
+inline size_t lz_dist_base(unsigned code) {
+    return code < 4 ? code + 1 : (size_t(2 + (code & 1)) << (code / 2 - 1)) + 1;
+}
+
+// Copies a match of len bytes from offset bytes back (offset >= 1, may
+// overlap). Works in 8/16-byte strides and may write up to LZ77_COPY_SLACK
+// bytes past op + len, so output buffers keep that much spare room.
+const size_t LZ77_COPY_SLACK = 16;
+
+inline void lz77_copy_match(uint8_t *op, size_t offset, size_t len) {
+    const uint8_t *src = op - offset;
+    if (offset >= 16) {
+        for (size_t k = 0; k < len; k += 16) std::memcpy(op + k, src + k, 16);
+    } else if (offset >= 8) {
+        for (size_t k = 0; k < len; k += 8) std::memcpy(op + k, src + k, 8);
+    } else {
+        // short period (RLE-like): byte steps until the run is 8 bytes long,
+        // after which an 8-byte stride with distance 8*k stays correct
+        size_t k = 0;
+        for (; k < len && k < 8; ++k) op[k] = src[k];
+        size_t dist = offset;
+        while (dist < 8) dist += offset;   // smallest multiple of offset >= 8
+        for (; k < len; k += 8) std::memcpy(op + k, op + k - dist, 8);
+    }
+}
+
+// Streaming counterpart of lz77_deserialize + lz77_decompress. Serialized
+// token bytes go in piecewise (tokens may straddle feed() calls) and output
+// leaves through sink in chunks, so memory is bounded by the window plus
+// one chunk rather than by the decoded size.
+class LZ77StreamDecoder {
+public:
+    typedef std::function<void(const uint8_t *data, size_t size)> Sink;
+
+    LZ77StreamDecoder(Sink sink, size_t windowSize = 65535, size_t chunkSize = 1 << 20);
+    void feed(const uint8_t *bytes, size_t n);
+    void finish();   // emits everything still buffered
+
+    uint64_t produced() const { return total; }
+
+private:
+    Sink sink;
+    size_t windowSize;
+    size_t chunkSize;
+    std::vector<uint8_t> history;  // last windowSize bytes already emitted, then pending output (+slack)
+    size_t fill;                   // bytes of history in use
+    size_t emitted;                // bytes of history already passed to sink
+    uint8_t partial[4];            // token bytes carried over from the previous feed()
+    size_t partialLen;
+    bool stopped;                  // unknown tag seen; the rest is ignored like lz77_deserialize does
+    uint64_t total;
+
+    size_t decodeToken(const uint8_t *p, size_t n);
+    void flushChunk();
+};
+
 // Streaming compressor class 
+// Match finder in the zlib/LZ4 style. History and not-yet-encoded lookahead
+// share one contiguous buffer, so a match may reach any byte within
+// windowSize, run across feed() boundaries and overlap itself (RLE-style).
+// Candidates come from fixed head[]/prev[] hash chains; memory is bounded by
+// the window size, not by the input size.
 class LZ77StreamCompressor {
 public:
-    LZ77StreamCompressor(size_t windowSize = 65535, size_t maxMatch = 255);
+    LZ77StreamCompressor(size_t windowSize = 65535, size_t maxMatch = 255,
+                         int level = LZ77_DEFAULT_LEVEL);
 
-    // Feed next chunk of input bytes (append to internal window)
+    // Feed next chunk of input bytes; the last maxMatch bytes are held back
+    // as lookahead until more input arrives or isLast is set
     void feed(const std::vector<uint8_t>& chunk, bool isLast = false);
+    void feed(const uint8_t* data, size_t size, bool isLast = false);
 
     // Get serialized output bytes for all emitted tokens so far
     std::vector<uint8_t> consumeOutput();
+    // Same tokens, unserialized (for the split-alphabet block coder)
+    std::vector<LZ77Token> consumeTokens();
+
+    // Encodes the next len bytes (data) as one match dist bytes back, found
+    // elsewhere (long distance matching); pending input is parsed first.
+    // dist may exceed the window: the caller guarantees those bytes exist.
+    void feedMatch(const uint8_t* data, size_t len, size_t dist);
+
+    // Preloads history (a trained dictionary) that matches may reference;
+    // call before the first feed(). Only the last windowSize bytes count.
+    void prime(const uint8_t* data, size_t size);
 
 private:
+    static constexpr unsigned HASH_BITS = 15;
+    static constexpr size_t OPTIMAL_BLOCK = 4096;  // positions per optimal-parse pass
+
+    struct Candidate {
+        size_t len;
+        size_t dist;
+    };
+
     size_t windowSize;
     size_t maxMatch;
-    std::deque<uint8_t> window;  // sliding window
-    std::unordered_map<uint32_t, std::deque<size_t>> dict;
+    LZ77Params params;
+    std::vector<uint8_t> buffer;    // up to 2*windowSize of history, then lookahead
+    uint64_t bufferStart;           // absolute position of buffer[0]
+    uint64_t cursor;                // absolute position of the next byte to encode
+    uint64_t inserted;              // positions below this are in the hash chains
+    std::vector<uint32_t> head;     // hash -> most recent position (mod 2^32)
+    std::vector<uint32_t> prev;     // position & chainMask -> previous position with same hash
+    size_t chainMask;
     std::vector<LZ77Token> pendingTokens;
-    size_t absolutePos;
 
-    void processChunk(const std::vector<uint8_t>& chunk, bool isLast);
-    static inline uint32_t make_key(const uint8_t* p);
+    // optimal parse: statistics of the emitted literal/length and distance
+    // codes drive the prices
+    std::vector<uint32_t> litLenCount, distCount;
+    std::vector<uint32_t> litLenPrice, distPrice;  // 1/16 bit units
+
+    void processChunk(const uint8_t* data, size_t size, bool isLast);
+    void parseGreedy(uint64_t stop, uint64_t end);
+    void parseOptimal(uint64_t stop, uint64_t end);
+    size_t longestMatch(uint64_t pos, uint64_t end, size_t &dist, std::vector<Candidate> *all = nullptr);
+    void insertUpTo(uint64_t pos, uint64_t end);
+    void emitLiteral(uint8_t lit);
+    void emitMatch(size_t len, size_t dist);
+    void refreshPrices();
+    inline uint32_t literalPrice(uint8_t lit) const;
+    inline uint32_t matchPrice(size_t len, size_t dist) const;
+    inline void insertPosition(uint64_t pos);
+    static inline uint32_t hash3(const uint8_t* p);
+};
+
+// Long distance matching: finds repeats of at least LDM_MIN_MATCH bytes up
+// to a 128 MiB window over a whole in-memory input, for the KP06 long mode.
+// Only positions whose rolling hash (of the preceding LDM_MIN_MATCH bytes)
+// hits a sampling mask are indexed, so the table stays small and a scan
+// costs about one hash update per byte. Blocks must be scanned in order.
+const size_t LDM_MIN_MATCH = 64;
+const unsigned LDM_MIN_WINDOW_LOG = 20;
+const unsigned LDM_MAX_WINDOW_LOG = 27;
+
+struct LongMatch {
+    uint64_t pos;      // where the repeat starts (absolute input position)
+    uint64_t length;
+    uint64_t dist;
+};
+
+class LongMatchFinder {
+public:
+    LongMatchFinder(const uint8_t* data, uint64_t size, unsigned windowLog);
+
+    // Streamed input: data now holds input bytes [base, end), which must
+    // include the window before the next findMatches range and the range
+    // itself. Matches are only extended up to end.
+    void setView(const uint8_t* view, uint64_t viewBase, uint64_t end) { data = view; base = viewBase; size = end; }
+
+    // Matches starting in [from, to), clipped at to; a match running past to
+    // is continued by the next call, which must start at to
+    std::vector<LongMatch> findMatches(uint64_t from, uint64_t to);
+
+private:
+    const uint8_t* data;           // input position base
+    uint64_t base = 0;
+    uint64_t size;                 // end of the input available
+    uint64_t window;
+    unsigned tableBits;
+    std::vector<uint64_t> table;   // bucket -> indexed position + 1
+    uint64_t scanned;              // next position to hash
+    uint64_t hash;                 // rolling hash of the bytes before scanned
+    LongMatch carry;               // remainder of a match cut at the last block end
+
+    void seek(uint64_t pos);       // restarts the rolling hash at pos
 };
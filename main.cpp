@@ -2,8 +2,11 @@
 #include <iostream>
 #include <string>
 #include <filesystem>
+#include <algorithm>
+#include <cstdlib>
 #include "huffman.h"
 #include "archive.h"
+#include "dictionary.h"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -12,8 +15,28 @@ void printUsage() {
     cout << "\nKittyPress v4 " << endl;
     cout << "Universal lossless archiver using LZ77 + Huffman (multi-file supported)\n\n";
     cout << "Usage:\n"
-         << "  kittypress compress <input1> [<input2> ...] <output.kitty>\n"
-         << "  kittypress decompress <archive.kitty> <outputFolder>\n";
+         << "  kittypress compress [options] [--dedup] [--solid] <input1> [<input2> ...] <output.kitty>\n"
+         << "  kittypress decompress [--threads N] [--dict D] <archive.kitty> <outputFolder>\n"
+         << "  kittypress extract [--threads N] [--dict D] <archive.kitty> <outputFolder> [pattern ...]\n"
+         << "  kittypress list <archive.kitty>\n"
+         << "  kittypress add [options] <archive.kitty> <input1> [<input2> ...]\n"
+         << "  kittypress update [options] [--checksum] <archive.kitty> <input1> [<input2> ...]\n"
+         << "  kittypress train [--size BYTES] <output.dict> <sample1> [<sample2> ...]\n\n"
+         << "Compress/add/update options:\n"
+         << "  -1 .. -9     compression level (1 = fastest, 9 = best, default 6)\n"
+         << "  --fast       no LZ77: each block is run-length coded, Huffman-only or stored\n"
+         << "  --ultra      slowest, highest ratio (deep optimal parse, checked against -9 per block)\n"
+         << "  --threads N  worker threads for block (de)compression (default: all cores)\n"
+         << "  --dict D     prime every block with a trained dictionary (needed again to extract)\n"
+         << "  --long[=N]   long distance matching over a 2^N byte window (N = 20..27, default 27);\n"
+         << "               finds repeats megabytes apart, but blocks then decode one at a time\n\n"
+         << "--dedup stores content-defined chunks once across all inputs; --solid packs\n"
+         << "inputs into one shared block stream, grouped by extension (best for many\n"
+         << "small files). Both are compress-only: such archives cannot be updated.\n\n"
+         << "add appends the inputs, replacing entries with the same path; update only\n"
+         << "writes inputs that are new or changed (size + mtime, or CRC-32 with --checksum).\n\n"
+         << "Extract patterns: '*' and '?' stay within a path segment, '**' spans\n"
+         << "segments, and a directory path selects everything below it.\n";
 }
 
 int main(int argc, char* argv[]) {
@@ -23,20 +46,90 @@ int main(int argc, char* argv[]) {
     string mode = argv[1];
 
     try {
-        if (mode == "compress") {
-            if (argc < 4) { printUsage(); return 1; }
-            vector<string> inputs;
-            for (int i = 2; i < argc - 1; ++i)
-                inputs.push_back(argv[i]);
-            string output = argv[argc - 1];
-
-            createArchive(inputs, output);
+        if (mode == "compress" || mode == "add" || mode == "update") {
+            CompressOptions options;
+            ArchiveUpdateOptions update;
+            update.onlyChanged = mode == "update";
+            vector<string> paths;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg.size() == 2 && arg[0] == '-' && arg[1] >= '1' && arg[1] <= '9')
+                    options.level = arg[1] - '0';
+                else if (arg == "--ultra")
+                    options.level = LZ77_LEVEL_ULTRA;
+                else if (arg == "--fast")
+                    options.level = COMPRESS_LEVEL_FAST;
+                else if (arg == "--threads" && i + 1 < argc)
+                    options.threads = max(1, atoi(argv[++i]));
+                else if (arg == "--dedup" && mode == "compress")
+                    options.dedup = true;
+                else if (arg == "--solid" && mode == "compress")
+                    options.solid = true;
+                else if (arg == "--dict" && i + 1 < argc)
+                    options.dictionary = loadDictionary(argv[++i]);
+                else if (arg == "--long")
+                    options.longWindowLog = LDM_MAX_WINDOW_LOG;
+                else if (arg.rfind("--long=", 0) == 0) {
+                    int log = atoi(arg.c_str() + 7);
+                    if (log < (int)LDM_MIN_WINDOW_LOG || log > (int)LDM_MAX_WINDOW_LOG)
+                        throw runtime_error("--long window log must be between 20 and 27.");
+                    options.longWindowLog = (unsigned)log;
+                }
+                else if (arg == "--checksum" && mode == "update")
+                    update.compareChecksum = true;
+                else
+                    paths.push_back(arg);
+            }
+            if (paths.size() < 2) { printUsage(); return 1; }
+            if (options.longWindowLog && (options.dictionary || options.dedup || options.solid))
+                throw runtime_error("--long cannot be combined with --dict, --dedup or --solid.");
+            if (options.level == COMPRESS_LEVEL_FAST && (options.dictionary || options.longWindowLog))
+                throw runtime_error("--fast cannot be combined with --dict or --long.");
+
+            if (mode == "compress") {
+                string output = paths.back();
+                paths.pop_back();
+                createArchive(paths, output, options);
+            } else {
+                string archive = paths.front();
+                paths.erase(paths.begin());
+                updateArchive(paths, archive, options, update);
+            }
+        }
+        else if (mode == "decompress" || mode == "extract") {
+            DecompressOptions options;
+            vector<string> paths;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg == "--threads" && i + 1 < argc)
+                    options.threads = max(1, atoi(argv[++i]));
+                else if (arg == "--dict" && i + 1 < argc)
+                    options.dictionary = loadDictionary(argv[++i]);
+                else
+                    paths.push_back(arg);
+            }
+            // decompress takes exactly archive + folder; extract also takes patterns
+            if (paths.size() < 2 || (mode == "decompress" && paths.size() != 2)) { printUsage(); return 1; }
+            vector<string> patterns(paths.begin() + 2, paths.end());
+            extractArchive(paths[0], paths[1], options, patterns);
+        }
+        else if (mode == "train") {
+            size_t size = DICT_DEFAULT_SIZE;
+            vector<string> paths;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg == "--size" && i + 1 < argc)
+                    size = (size_t)max(0LL, atoll(argv[++i]));
+                else
+                    paths.push_back(arg);
+            }
+            if (paths.size() < 2) { printUsage(); return 1; }
+            string output = paths.front();
+            paths.erase(paths.begin());
+            trainDictionaryFile(paths, output, size);
         }
-        else if (mode == "decompress") {
-            if (argc < 4) { printUsage(); return 1; }
-            string archive = argv[2];
-            string folder  = argv[3];
-            extractArchive(archive, folder);
+        else if (mode == "list") {
+            listArchive(argv[2]);
         }
         else {
             printUsage();
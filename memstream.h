@@ -0,0 +1,69 @@
+// memstream.h
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <vector>
+
+// Read-only streambuf over caller-owned memory (no copy). Seekable, so it
+// can back the istream side of the stream API.
+class MemoryInputBuf : public std::streambuf {
+public:
+    MemoryInputBuf(const uint8_t *data, size_t size) {
+        char *p = const_cast<char*>(reinterpret_cast<const char*>(data));
+        setg(p, p, p + size);
+    }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+        off_type base = dir == std::ios_base::beg ? 0
+                      : dir == std::ios_base::cur ? off_type(gptr() - eback())
+                      : off_type(egptr() - eback());
+        return seekpos(pos_type(base + off), which);
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        off_type p = off_type(pos);
+        if (!(which & std::ios_base::in) || p < 0 || p > off_type(egptr() - eback())) return pos_type(off_type(-1));
+        setg(eback(), eback() + p, egptr());
+        return pos;
+    }
+};
+
+// Write streambuf appending to a vector. Seeking back overwrites in place,
+// so headers can be patched after the fact.
+class VectorOutputBuf : public std::streambuf {
+public:
+    explicit VectorOutputBuf(std::vector<uint8_t> &target) : out(target), pos(target.size()) {}
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+        return ch;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        size_t len = (size_t)n;
+        if (pos + len > out.size()) out.resize(pos + len);
+        memcpy(out.data() + pos, s, len);
+        pos += len;
+        return n;
+    }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        off_type base = dir == std::ios_base::beg ? 0
+                      : dir == std::ios_base::cur ? off_type(pos)
+                      : off_type(out.size());
+        return seekpos(pos_type(base + off), which);
+    }
+    pos_type seekpos(pos_type p, std::ios_base::openmode which) override {
+        off_type target = off_type(p);
+        if (!(which & std::ios_base::out) || target < 0 || target > off_type(out.size())) return pos_type(off_type(-1));
+        pos = (size_t)target;
+        return p;
+    }
+
+private:
+    std::vector<uint8_t> &out;
+    size_t pos;
+};
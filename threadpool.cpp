@@ -0,0 +1,69 @@
+// threadpool.cpp
+#include "threadpool.h"
+#include <stdexcept>
+
+ThreadPool::ThreadPool(size_t threads) : stopping(false) {
+    if (threads == 0) threads = 1;
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+        workers.emplace_back([this]() { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &w : workers) w.join();
+}
+
+size_t ThreadPool::resolveThreadCount(int requested) {
+    if (requested > 0) return (size_t)requested;
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw > 0 ? hw : 1;
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;   // stopping and drained
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+// OrderedWriter
+
+OrderedWriter::OrderedWriter(std::ostream &stream, size_t maxQueued, uint64_t startOffset)
+    : out(stream), maxPending(maxQueued > 0 ? maxQueued : 1), written(startOffset) {}
+
+void OrderedWriter::push(Producer produce, Committed onCommit) {
+    while (pending.size() >= maxPending) commitFront();
+    pending.push_back(Pending{ std::move(produce), std::move(onCommit) });
+}
+
+void OrderedWriter::push(std::vector<uint8_t> bytes, Committed onCommit) {
+    auto shared = std::make_shared<std::vector<uint8_t>>(std::move(bytes));
+    push([shared]() { return std::move(*shared); }, std::move(onCommit));
+}
+
+void OrderedWriter::drain() {
+    while (!pending.empty()) commitFront();
+}
+
+void OrderedWriter::commitFront() {
+    Pending item = std::move(pending.front());
+    pending.pop_front();
+    std::vector<uint8_t> bytes = item.produce();
+    uint64_t at = written;
+    if (!bytes.empty()) out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    if (!out) throw std::runtime_error("Failed writing output stream.");
+    written += bytes.size();
+    if (item.onCommit) item.onCommit(at, bytes);
+}
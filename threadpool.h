@@ -0,0 +1,85 @@
+// threadpool.h
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads consuming a FIFO task queue.
+// submit() returns a future; exceptions thrown by a task surface from get().
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template <class F>
+    auto submit(F&& task) -> std::future<decltype(task())> {
+        typedef decltype(task()) Result;
+        auto job = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        std::future<Result> result = job->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([job]() { (*job)(); });
+        }
+        wake.notify_one();
+        return result;
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // 0 (auto) maps to the number of hardware threads
+    static size_t resolveThreadCount(int requested);
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void workerLoop();
+};
+
+// Commits byte chunks to a stream strictly in the order they were pushed,
+// whatever order the pool finishes them in. Producers run on the calling
+// (writer) thread at commit time, typically waiting on a pool future; at most
+// maxPending chunks are queued, which bounds in-flight memory.
+class OrderedWriter {
+public:
+    typedef std::function<std::vector<uint8_t>()> Producer;
+    typedef std::function<void(uint64_t offset, const std::vector<uint8_t> &bytes)> Committed;
+
+    // startOffset: stream position of the first byte written (offsets are reported from it)
+    OrderedWriter(std::ostream &out, size_t maxPending, uint64_t startOffset = 0);
+
+    void push(Producer produce, Committed onCommit = nullptr);
+    void push(std::vector<uint8_t> bytes, Committed onCommit = nullptr);
+    void drain();
+
+    // Stream position after everything committed so far
+    uint64_t offset() const { return written; }
+    std::ostream &stream() { return out; }
+
+private:
+    struct Pending {
+        Producer produce;
+        Committed onCommit;
+    };
+
+    std::ostream &out;
+    size_t maxPending;
+    std::deque<Pending> pending;
+    uint64_t written;
+
+    void commitFront();
+};